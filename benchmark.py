@@ -0,0 +1,553 @@
+import os, sys, time, shutil, random, subprocess, argparse, json, statistics, pqmarkup_lite
+from typing import List, Dict, Tuple, Optional
+
+# Cross-implementation benchmark: runs every available implementation (pqmarkup_lite.py, the C++ engines and the Nim ports)
+# on the same corpus, checks that their outputs are byte-identical and reports throughput ratios.
+# Every implementation is run through its command line interface (`pqmarkup_lite input-file output-file`),
+# so process startup and file I/O are included in the measured time (use large generated documents to make them negligible).
+# With `--rss` peak memory usage is measured instead on documents of up to several gigabytes,
+# with `--batch` the I/O methods of the batch mode are compared on many small files,
+# with `--site` full and incremental site builds are timed,
+# with `--check` validation is compared with conversion,
+# with `--compact` sizes of the output with full and compact ohd markup (`--compact`) are compared
+# and with `--counters` hardware performance counters (Linux only) are read for every run instead of measuring time alone.
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+
+class Implementation:
+    name : str
+    command : List[str]
+    def __init__(self, name, command):
+        self.name = name
+        self.command = command
+
+def find_cxx() -> Optional[str]:
+    return os.getenv('CXX') or shutil.which('c++') or shutil.which('g++') or shutil.which('clang++')
+
+def build_implementations(build_dir : str, only : Optional[List[str]]) -> List[Implementation]:
+    impls : List[Implementation] = [Implementation('py', [sys.executable, os.path.join(ROOT, 'pqmarkup_lite.py')])]
+
+    cxx = find_cxx()
+    for engine in ['utf8', 'utf8_sv', 'utf16']:
+        name = 'cpp-' + engine
+        if only is not None and name not in only:
+            continue
+        if cxx is None:
+            print('Skipping ' + name + ': no C++ compiler found (set CXX)')
+            continue
+        exe = os.path.join(build_dir, engine)
+        src = os.path.join(ROOT, 'cpp', engine, engine + '.cpp')
+        if not os.path.isfile(exe) or os.path.getmtime(exe) < os.path.getmtime(src):
+            r = subprocess.run([cxx, '-std=c++17', '-O2', '-DNDEBUG', '-o', exe, src], capture_output = True, text = True)
+            if r.returncode != 0:
+                print('Skipping ' + name + ': compilation failed:\n' + r.stderr)
+                continue
+        impls.append(Implementation(name, [exe]))
+
+    nim = shutil.which('nim')
+    for n in ['1', '2']:
+        name = 'nim' + n
+        if only is not None and name not in only:
+            continue
+        if nim is None:
+            print('Skipping ' + name + ': nim compiler not found')
+            continue
+        exe = os.path.join(build_dir, 'pqmarkup_lite' + n)
+        src = os.path.join(ROOT, 'nim', 'pqmarkup_lite' + n + '.nim')
+        if not os.path.isfile(exe) or os.path.getmtime(exe) < os.path.getmtime(src):
+            r = subprocess.run([nim, 'c', '-d:release', '--hints:off', '--nimcache:' + os.path.join(build_dir, 'nimcache' + n), '-o:' + exe, src], capture_output = True, text = True)
+            if r.returncode != 0:
+                print('Skipping ' + name + ': compilation failed:\n' + r.stderr)
+                continue
+        impls.append(Implementation(name, [exe]))
+
+    if only is not None:
+        impls = [impl for impl in impls if impl.name in only]
+    return impls
+
+PROBE = "`a` ``b`` ‘c’ [[[d]]] *‘e’ [f] {g}"
+
+def valid_fragments(candidates : List[str]) -> List[str]:
+    # Not every candidate can be simply concatenated with others (e.g. a line of i.data can be a part of a multiline quotation
+    # or a code block), so keep only those which are valid on their own and do not affect conversion of the surrounding text.
+    fragments = []
+    probe_html = pqmarkup_lite.to_html(PROBE)
+    for f in candidates:
+        try:
+            f_html = pqmarkup_lite.to_html(f)
+            html = pqmarkup_lite.to_html(PROBE + "\n\n" + f + "\n\n" + PROBE)
+        except Exception: # not only pqmarkup_lite.Exception: pqmarkup_lite.py can fail with IndexError on some invalid inputs
+            continue
+        if html.startswith(probe_html) and html.endswith(probe_html) and f_html in html:
+            fragments.append(f)
+    return fragments
+
+def generate_document(kind : str, size : int, seed : int, lines : List[str], fragments : List[str]) -> str:
+    rnd = random.Random(seed)
+    parts : List[str] = []
+    total = 0
+    while total < size:
+        if kind == 'markup':
+            part = rnd.choice(fragments)
+        elif kind == 'prose':
+            part = rnd.choice(lines)
+        else: # mixed
+            part = rnd.choice(fragments) if rnd.random() < 0.3 else rnd.choice(lines)
+        parts.append(part)
+        total += len(part.encode('utf-8')) + 2
+    doc = "\n\n".join(parts)
+    pqmarkup_lite.to_html(doc) # generated documents must be valid
+    return doc
+
+def run(impl : Implementation, infile : str, outfile : str) -> float:
+    start = time.perf_counter()
+    r = subprocess.run(impl.command + [infile, outfile], capture_output = True)
+    elapsed = time.perf_counter() - start
+    if r.returncode != 0:
+        raise RuntimeError(impl.name + ' failed on ' + infile + ': ' + r.stderr.decode('utf-8', 'replace'))
+    return elapsed
+
+# A child process started directly from Python inherits the peak RSS of the Python process (its memory is counted until `exec`),
+# so implementations are started through this small launcher which reports the peak RSS of its own child.
+PEAK_RSS_LAUNCHER = r"""
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+int main(int argc, char *argv[])
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv(argv[1], argv + 1);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (pid < 0 || wait4(pid, &status, 0, &ru) < 0)
+        return 127;
+    fprintf(stderr, "%ld\n", ru.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+"""
+
+def build_peak_rss_launcher(build_dir : str) -> str:
+    exe = os.path.join(build_dir, 'peak_rss')
+    if not os.path.isfile(exe):
+        cxx = find_cxx()
+        if cxx is None:
+            sys.exit('A C++ compiler is required for --rss (set CXX)')
+        src = exe + '.cpp'
+        open(src, 'w').write(PEAK_RSS_LAUNCHER)
+        r = subprocess.run([cxx, '-O2', '-o', exe, src], capture_output = True, text = True)
+        if r.returncode != 0:
+            sys.exit('Compilation of ' + src + ' failed:\n' + r.stderr)
+    return exe
+
+def run_rss(launcher : str, impl : Implementation, infile : str, outfile : str) -> Tuple[float, Optional[int]]:
+    # Returns elapsed time and peak resident set size in bytes (or None if the implementation failed, e.g. ran out of memory)
+    start = time.perf_counter()
+    r = subprocess.run([launcher, shutil.which(impl.command[0]) or impl.command[0]] + impl.command[1:] + [infile, outfile], capture_output = True)
+    elapsed = time.perf_counter() - start
+    if r.returncode != 0:
+        return elapsed, None
+    return elapsed, int(r.stderr.decode().split()[-1]) * (1 if sys.platform == 'darwin' else 1024)
+
+def rss_benchmark(impls : List[Implementation], sizes : List[int], build_dir : str, corpus_dir : str, block : str):
+    # Peak memory usage must not depend on the size of the document for implementations with streaming output,
+    # so documents up to several gigabytes are built by repeating `block` and written directly to disk.
+    launcher = build_peak_rss_launcher(build_dir)
+    print('%-11s %12s %10s %12s %9s' % ('impl', 'size', 'time ms', 'peak RSS', 'RSS/size'))
+    block_bytes = block.encode('utf-8')
+    for size in sizes:
+        fname = os.path.join(corpus_dir, 'rss.pq')
+        with open(fname, 'wb') as f:
+            written = 0
+            while written < size:
+                if written != 0:
+                    f.write(b"\n\n")
+                    written += 2
+                f.write(block_bytes)
+                written += len(block_bytes)
+        for impl in impls:
+            outfile = os.path.join(corpus_dir, 'rss-out.html')
+            elapsed, rss = run_rss(launcher, impl, fname, outfile)
+            if rss is None:
+                print('%-11s %12d %10s %12s' % (impl.name, written, '-', 'failed'))
+            else:
+                print('%-11s %12d %10.0f %10.1fMB %9.3f' % (impl.name, written, elapsed * 1000, rss / 1e6, rss / written))
+            if os.path.exists(outfile):
+                os.remove(outfile)
+        os.remove(fname)
+
+# Reads hardware performance counters of its child through perf_event_open() the way `perf stat` does: the child waits until
+# the counters are attached to it (with `enable_on_exec`, so only the implementation itself is counted, including its threads)
+# and then runs the implementation. Counts of user space only are written to the file given as the first argument, one
+# `name value` line per event (`name -` if the event is not supported), scaled up if the events were multiplexed.
+PERF_COUNTERS_LAUNCHER = r"""
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+static const struct {const char *name; uint32_t type; uint64_t config;} events[] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1D-read-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    {"LLC-read-misses", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+};
+enum {N = sizeof(events) / sizeof(*events)};
+int main(int argc, char *argv[])
+{
+    int go[2];
+    if (argc < 3 || pipe(go) != 0)
+        return 127;
+    pid_t pid = fork();
+    if (pid == 0) {
+        char c;
+        close(go[1]);
+        if (read(go[0], &c, 1) != 1)
+            _exit(127);
+        execv(argv[2], argv + 2);
+        _exit(127);
+    }
+    if (pid < 0)
+        return 127;
+    int fds[N];
+    for (int e = 0; e < N; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = 1;
+        attr.enable_on_exec = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[e] = (int)syscall(__NR_perf_event_open, &attr, pid, -1, -1, 0);
+    }
+    close(go[0]);
+    if (write(go[1], "", 1) != 1)
+        return 127;
+    close(go[1]);
+    int status;
+    if (waitpid(pid, &status, 0) < 0)
+        return 127;
+    FILE *f = fopen(argv[1], "w");
+    if (f == NULL)
+        return 127;
+    for (int e = 0; e < N; e++) {
+        uint64_t v[3]; // value, time enabled, time running
+        if (fds[e] >= 0 && read(fds[e], v, sizeof(v)) == sizeof(v) && v[2] != 0)
+            fprintf(f, "%s %.0f\n", events[e].name, (double)v[0] * v[1] / v[2]);
+        else
+            fprintf(f, "%s -\n", events[e].name);
+    }
+    fclose(f);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128;
+}
+"""
+
+def build_counters_launcher(build_dir : str) -> str:
+    exe = os.path.join(build_dir, 'perf_counters')
+    if not os.path.isfile(exe):
+        cxx = find_cxx()
+        if cxx is None:
+            sys.exit('A C++ compiler is required for --counters (set CXX)')
+        src = exe + '.cpp'
+        open(src, 'w').write(PERF_COUNTERS_LAUNCHER)
+        r = subprocess.run([cxx, '-O2', '-o', exe, src], capture_output = True, text = True)
+        if r.returncode != 0:
+            sys.exit('Compilation of ' + src + ' failed:\n' + r.stderr)
+    return exe
+
+def run_counters(launcher : str, impl : Implementation, infile : str, outfile : str, build_dir : str) -> Dict[str, Optional[float]]:
+    counts_file = os.path.join(build_dir, 'counters.txt')
+    r = subprocess.run([launcher, counts_file, shutil.which(impl.command[0]) or impl.command[0]] + impl.command[1:] + [infile, outfile], capture_output = True)
+    if r.returncode != 0:
+        raise RuntimeError(impl.name + ' failed on ' + infile + ': ' + r.stderr.decode('utf-8', 'replace'))
+    counts : Dict[str, Optional[float]] = {}
+    for line in open(counts_file).read().splitlines():
+        name, value = line.split()
+        counts[name] = None if value == '-' else float(value)
+    return counts
+
+# Rough costs in cycles used to estimate the share of cycles lost to branch misses and to loads missing the last level cache
+# (they vary between CPUs, so the estimates only tell which of the two is worth looking at first)
+BRANCH_MISS_PENALTY = 15
+LLC_MISS_PENALTY = 200
+
+def counters_benchmark(impls : List[Implementation], corpus : List[Tuple[str, str]], repeat : int, build_dir : str) -> List[Dict]:
+    # Reports per implementation and document the medians (over `repeat` runs) of IPC, cycles and instructions per input byte,
+    # branch and cache misses per KB of input and the estimated shares of cycles lost to branch misses and to LLC misses
+    launcher = build_counters_launcher(build_dir)
+    print('%-14s %-11s %10s %6s %9s %9s %11s %11s %11s %9s %9s' % ('document', 'impl', 'size', 'IPC', 'cycles/B', 'instr/B',
+          'br-miss/KB', 'L1D-miss/KB', 'LLC-miss/KB', 'br-stall', 'mem-stall'))
+    results : List[Dict] = []
+    unsupported = set()
+    for doc_name, doc_file in corpus:
+        size = os.path.getsize(doc_file)
+        for impl in impls:
+            outfile = os.path.join(build_dir, 'out-' + impl.name + '.html')
+            runs = [run_counters(launcher, impl, doc_file, outfile, build_dir) for _ in range(repeat)]
+            counts : Dict[str, Optional[float]] = {}
+            for name in runs[0]:
+                values = [r[name] for r in runs if r[name] is not None]
+                counts[name] = statistics.median(values) if len(values) == len(runs) else None
+                if counts[name] is None:
+                    unsupported.add(name)
+            def ratio(a : str, b : Optional[str], scale : float = 1, divisor : float = 1) -> str:
+                if counts.get(a) is None or (b is not None and not counts.get(b)):
+                    return '-'
+                return '%.2f' % (counts[a] * scale / (counts[b] if b is not None else 1) / divisor)
+            kb = size / 1024
+            print('%-14s %-11s %10d %6s %9s %9s %11s %11s %11s %8s%% %8s%%' % (doc_name, impl.name, size,
+                  ratio('instructions', 'cycles'), ratio('cycles', None, divisor = size), ratio('instructions', None, divisor = size),
+                  ratio('branch-misses', None, divisor = kb), ratio('L1D-read-misses', None, divisor = kb), ratio('LLC-read-misses', None, divisor = kb),
+                  ratio('branch-misses', 'cycles', 100 * BRANCH_MISS_PENALTY), ratio('LLC-read-misses', 'cycles', 100 * LLC_MISS_PENALTY)))
+            results.append({'document': doc_name, 'impl': impl.name, 'size': size, 'counters': counts})
+    if unsupported:
+        print('Not supported here: ' + ', '.join(sorted(unsupported)) + ' (check /proc/sys/kernel/perf_event_paranoid and whether the (virtual) CPU exposes a PMU)')
+    print('br-stall and mem-stall are estimated with %d cycles per branch miss and %d per LLC miss' % (BRANCH_MISS_PENALTY, LLC_MISS_PENALTY))
+    return results
+
+def evict_from_page_cache(fname : str):
+    # Dropping clean pages of a file does not require root (unlike writing to /proc/sys/vm/drop_caches)
+    fd = os.open(fname, os.O_RDONLY)
+    try:
+        os.fsync(fd)
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+def batch_benchmark(impls : List[Implementation], files_count : int, repeat : int, corpus_dir : str, seed : int, lines : List[str], fragments : List[str]):
+    # Compares I/O methods of `--batch` mode on many small files read from a cold page cache
+    batch_dir = os.path.join(corpus_dir, 'batch')
+    shutil.rmtree(batch_dir, ignore_errors = True)
+    os.makedirs(batch_dir)
+    rnd = random.Random(seed)
+    inputs = []
+    for n in range(files_count):
+        fname = os.path.join(batch_dir, '%06d.pq' % n)
+        open(fname, 'w', encoding = 'utf-8', newline = "\n").write(generate_document('mixed', rnd.randint(512, 8192), seed + n, lines, fragments))
+        inputs.append(fname)
+    file_list = "\n".join(inputs).encode()
+    outputs = [fname[:-3] + '.html' for fname in inputs]
+    cold = hasattr(os, 'posix_fadvise')
+
+    print('%-11s %-8s %8s %10s %12s' % ('impl', 'io', 'files', 'median ms', 'files/s'))
+    for impl in impls:
+        if not impl.name.startswith('cpp-utf8_sv'):
+            continue
+        ref_outputs = None
+        for io in ['sync', 'threads', 'uring']:
+            times = []
+            for _ in range(repeat):
+                for fname in outputs:
+                    if os.path.exists(fname):
+                        os.remove(fname)
+                if hasattr(os, 'sync'):
+                    os.sync() # do not let writeback of the previous run interfere
+                if cold:
+                    for fname in inputs:
+                        evict_from_page_cache(fname)
+                start = time.perf_counter()
+                r = subprocess.run(impl.command + ['--batch', '--io=' + io, '-'], input = file_list, capture_output = True)
+                times.append(time.perf_counter() - start)
+                if r.returncode != 0:
+                    raise RuntimeError(impl.name + ' --batch --io=' + io + ' failed: ' + r.stderr.decode('utf-8', 'replace'))
+            results = [open(fname, 'rb').read() for fname in outputs]
+            if ref_outputs is None:
+                ref_outputs = results
+            median = statistics.median(times)
+            print('%-11s %-8s %8d %10.1f %12.0f%s' % (impl.name, io, files_count, median * 1000, files_count / median,
+                  '' if results == ref_outputs else '  OUTPUT DIFFERS'))
+    if not cold:
+        print('Note: page cache was not dropped (posix_fadvise is not available)')
+    shutil.rmtree(batch_dir)
+
+def site_benchmark(impls : List[Implementation], pages_count : int, repeat : int, corpus_dir : str, seed : int, lines : List[str], fragments : List[str]):
+    # Times `--site` builds: a full build, a no-op rebuild and a rebuild after one page and after a shared dependency have changed
+    source_dir = os.path.join(corpus_dir, 'site')
+    shutil.rmtree(source_dir, ignore_errors = True)
+    rnd = random.Random(seed)
+    blocks = [generate_document('mixed', 4096, seed + n, lines, fragments) for n in range(64)]
+    for n in range(pages_count):
+        page_dir = os.path.join(source_dir, 'd%03d' % (n // 100))
+        os.makedirs(page_dir, exist_ok = True)
+        depends = "[[[depends: ../shared.txt]]]\n" if n % 10 == 0 else '' # every tenth page depends on a shared file
+        open(os.path.join(page_dir, 'p%05d.pq' % n), 'w', encoding = 'utf-8', newline = "\n").write(depends + rnd.choice(blocks))
+    open(os.path.join(source_dir, 'shared.txt'), 'w').write('1')
+
+    print('%-11s %8s %-22s %10s' % ('impl', 'pages', 'build', 'median ms'))
+    for impl in impls:
+        if not impl.name.startswith('cpp-utf8_sv'):
+            continue
+        output_dir = os.path.join(corpus_dir, 'site-out')
+        def build(name, prepare = None):
+            times = []
+            for _ in range(repeat):
+                if prepare is not None:
+                    prepare()
+                start = time.perf_counter()
+                r = subprocess.run(impl.command + ['--site', source_dir, output_dir], capture_output = True)
+                times.append(time.perf_counter() - start)
+                if r.returncode != 0:
+                    raise RuntimeError(impl.name + ' --site failed: ' + r.stderr.decode('utf-8', 'replace'))
+            print('%-11s %8d %-22s %10.1f' % (impl.name, pages_count, name, statistics.median(times) * 1000))
+        def touch_page():
+            fname = os.path.join(source_dir, 'd000', 'p00001.pq')
+            open(fname, 'a', encoding = 'utf-8').write("\nx")
+        def touch_shared():
+            open(os.path.join(source_dir, 'shared.txt'), 'a').write('1')
+        build('full', lambda: shutil.rmtree(output_dir, ignore_errors = True))
+        build('no-op')
+        build('one page changed', touch_page)
+        build('dependency changed', touch_shared)
+        shutil.rmtree(output_dir)
+    shutil.rmtree(source_dir)
+
+def check_benchmark(impls : List[Implementation], corpus : List[Tuple[str, str]], repeat : int, build_dir : str):
+    # Compares `--check` (validation only) with full conversion
+    print('%-14s %-11s %10s %12s %12s %8s' % ('document', 'impl', 'size', 'convert ms', 'check ms', 'speedup'))
+    for impl in impls:
+        if not impl.name.startswith('cpp-utf8_sv'):
+            continue
+        for doc_name, doc_file in corpus:
+            outfile = os.path.join(build_dir, 'out-' + impl.name + '.html')
+            convert = statistics.median([run(impl, doc_file, outfile) for _ in range(repeat)])
+            times = []
+            for _ in range(repeat):
+                start = time.perf_counter()
+                r = subprocess.run(impl.command + ['--check', doc_file], capture_output = True)
+                times.append(time.perf_counter() - start)
+                if r.returncode != 0:
+                    raise RuntimeError(impl.name + ' --check failed on ' + doc_file + ': ' + r.stderr.decode('utf-8', 'replace'))
+            check = statistics.median(times)
+            print('%-14s %-11s %10d %12.2f %12.2f %7.2fx' % (doc_name, impl.name, os.path.getsize(doc_file), convert * 1000, check * 1000, convert / check))
+
+def compact_benchmark(impls : List[Implementation], corpus : List[Tuple[str, str]], repeat : int, build_dir : str):
+    # Compares output sizes (raw and gzip-compressed) and conversion times with full and compact ohd markup
+    import gzip
+    print('%-14s %-11s %10s %11s %11s %7s %10s %10s %7s %9s %9s' % ('document', 'impl', 'size', 'full', 'compact', 'saved', 'full.gz', 'compact.gz', 'saved', 'full ms', 'compact ms'))
+    for impl in impls:
+        if not impl.name.startswith('cpp-utf8_sv'):
+            continue
+        for doc_name, doc_file in corpus:
+            sizes, gz_sizes, times = [], [], []
+            for options in [[], ['--compact']]:
+                outfile = os.path.join(build_dir, 'out-' + impl.name + '.html')
+                times.append(statistics.median([run(Implementation(impl.name, impl.command + options), doc_file, outfile) for _ in range(repeat)]))
+                output = open(outfile, 'rb').read()
+                sizes.append(len(output))
+                gz_sizes.append(len(gzip.compress(output, 6)))
+            print('%-14s %-11s %10d %11d %11d %6.1f%% %10d %10d %6.1f%% %9.2f %9.2f' % (doc_name, impl.name, os.path.getsize(doc_file), sizes[0], sizes[1],
+                  100 * (1 - sizes[1] / sizes[0]), gz_sizes[0], gz_sizes[1], 100 * (1 - gz_sizes[1] / gz_sizes[0]), times[0] * 1000, times[1] * 1000))
+
+def parse_size(s : str) -> int:
+    mult = {'K': 1024, 'M': 1024*1024, 'G': 1024*1024*1024}
+    return int(s[:-1]) * mult[s[-1].upper()] if s[-1].upper() in mult else int(s)
+
+def main():
+    ap = argparse.ArgumentParser(description = 'Benchmark all available pqmarkup-lite implementations against each other.')
+    ap.add_argument('--impl', action = 'append', help = 'run only the given implementation(s): py, cpp-utf8, cpp-utf8_sv, cpp-utf16, nim1, nim2')
+    ap.add_argument('--sizes', default = '256K,4M', help = 'comma-separated sizes of generated documents (default: 256K,4M)')
+    ap.add_argument('--kinds', default = 'prose,markup,mixed', help = 'kinds of generated documents (default: prose,markup,mixed)')
+    ap.add_argument('--repeat', type = int, default = 5, help = 'number of runs per implementation and document (default: 5)')
+    ap.add_argument('--seed', type = int, default = 1)
+    ap.add_argument('--build-dir', default = os.path.join(ROOT, '_bench_build'))
+    ap.add_argument('--json', help = 'write results to this file (for comparison between runs)')
+    ap.add_argument('--batch', type = int, metavar = 'FILES', help = 'measure files per second of `--batch` mode with each I/O method '
+                    'on the given number of small files read from a cold page cache')
+    ap.add_argument('--check', action = 'store_true', help = 'compare `--check` (validation without conversion) with full conversion')
+    ap.add_argument('--compact', action = 'store_true', help = 'compare output sizes with full and compact (`--compact`) ohd markup')
+    ap.add_argument('--counters', action = 'store_true', help = 'read hardware performance counters (cycles, instructions, branch and cache misses) '
+                    'through perf_event_open (Linux only); pqmarkup_lite.py is skipped unless requested with --impl')
+    ap.add_argument('--site', type = int, metavar = 'PAGES', help = 'measure full and incremental `--site` builds of a generated site with the given number of pages')
+    ap.add_argument('--rss', nargs = '?', const = '1M,16M,256M,4G', help = 'measure peak memory usage on mixed documents of the given sizes '
+                    '(default: 1M,16M,256M,4G) instead of throughput; pqmarkup_lite.py is skipped unless requested with --impl')
+    args = ap.parse_args()
+
+    os.makedirs(args.build_dir, exist_ok = True)
+    impls = build_implementations(args.build_dir, args.impl)
+    if (args.rss is not None or args.counters) and args.impl is None:
+        impls = [impl for impl in impls if impl.name != 'py']
+    if len(impls) == 0:
+        sys.exit('No implementations to benchmark')
+    reference = impls[0] # outputs of all implementations are compared with the first one (pqmarkup_lite.py unless excluded with --impl)
+
+    corpus_dir = os.path.join(args.build_dir, 'corpus')
+    os.makedirs(corpus_dir, exist_ok = True)
+    corpus : List[Tuple[str, str]] = [('i.data', os.path.join(ROOT, 'i.data'))]
+    idata = open(os.path.join(ROOT, 'i.data'), encoding = 'utf-8-sig').read()
+    lines = valid_fragments([l for l in idata.split("\n") if l != ''])
+    fragments = valid_fragments([test.split(' (()) ')[0] for test in open(os.path.join(ROOT, 'tests.txt'), encoding = 'utf-8').read().split("|\n\n|")])
+    if args.site is not None:
+        site_benchmark(impls, args.site, args.repeat, corpus_dir, args.seed, lines, fragments)
+        return
+    if args.batch is not None:
+        batch_benchmark(impls, args.batch, args.repeat, corpus_dir, args.seed, lines, fragments)
+        return
+    if args.rss is not None:
+        rss_benchmark(impls, [parse_size(size) for size in args.rss.split(',')], args.build_dir, corpus_dir,
+                      generate_document('mixed', 1024*1024, args.seed, lines, fragments))
+        return
+    for kind in args.kinds.split(','):
+        for size in args.sizes.split(','):
+            name = kind + '-' + size
+            fname = os.path.join(corpus_dir, name + '.pq')
+            open(fname, 'w', encoding = 'utf-8', newline = "\n").write(generate_document(kind, parse_size(size), args.seed, lines, fragments))
+            corpus.append((name, fname))
+    if args.check:
+        check_benchmark(impls, corpus, args.repeat, args.build_dir)
+        return
+    if args.compact:
+        compact_benchmark(impls, corpus, args.repeat, args.build_dir)
+        return
+    if args.counters:
+        if not sys.platform.startswith('linux'):
+            sys.exit('--counters requires Linux (perf_event_open)')
+        results = counters_benchmark(impls, corpus, args.repeat, args.build_dir)
+        if args.json:
+            json.dump(results, open(args.json, 'w'), indent = 1)
+        return
+
+    results : List[Dict] = []
+    mismatches = 0
+    print('%-14s %-11s %10s %10s %10s %9s  %s' % ('document', 'impl', 'size', 'median ms', 'min ms', 'MB/s', 'vs ' + reference.name))
+    for doc_name, doc_file in corpus:
+        size = os.path.getsize(doc_file)
+        ref_output = None
+        ref_time = None
+        for impl in impls:
+            outfile = os.path.join(args.build_dir, 'out-' + impl.name + '.html')
+            times = [run(impl, doc_file, outfile) for _ in range(args.repeat)]
+            output = open(outfile, 'rb').read()
+            median = statistics.median(times)
+            if ref_output is None:
+                ref_output = output
+                ref_time = median
+                same = True
+            else:
+                same = output == ref_output
+                if not same:
+                    mismatches += 1
+            print('%-14s %-11s %10d %10.2f %10.2f %9.2f  %6.2fx%s' % (doc_name, impl.name, size, median * 1000, min(times) * 1000,
+                  size / median / 1e6, ref_time / median, '' if same else '  OUTPUT DIFFERS'))
+            results.append({'document': doc_name, 'impl': impl.name, 'size': size, 'times': times,
+                            'median': median, 'identical': same})
+
+    if args.json:
+        json.dump(results, open(args.json, 'w'), indent = 1)
+    if mismatches != 0:
+        print(str(mismatches) + ' output(s) differ from ' + reference.name)
+        sys.exit(1)
+    print('All outputs are identical')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,735 @@
+#pragma once
+// Batch conversion of many files (`--batch`, also used by `--site`). This is a part of utf8_sv.cpp, which includes it after
+// the engine, InputFile, PageTemplate and GzipEncoder.
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+
+// Batch conversion (`--batch`): every input file `name.ext` is converted into `name.html` with the page wrapper.
+// The synchronous path reads and writes files one by one with fopen/fread/fwrite. For trees of many small files this is bound
+// by syscalls and disk latency rather than by conversion, so on Linux the files are read and written by an io_uring based
+// pipeline which keeps many files in flight and converts them on worker threads, or (when io_uring is not available)
+// by a pool of threads with `posix_fadvise()` readahead of the files ahead of them.
+struct BatchJob
+{
+    std::string input_path, output_path;
+    std::string error; // empty if the file has been converted successfully
+};
+
+std::string batch_output_path(const std::string &input_path)
+{
+    size_t dot = input_path.rfind('.');
+    if (dot == std::string::npos || input_path.find_first_of("/\\", dot) != std::string::npos)
+        return input_path + ".html";
+    return input_path.substr(0, dot) + ".html";
+}
+
+// Converts `contents` of a file wrapped into the page template (`out` must be clear)
+bool batch_convert(Converter &converter, const PageTemplate &page, std::string_view contents, Output &out, std::string &error)
+{
+    if (contents.substr(0, 3) == "\xEF\xBB\xBF")
+        contents.remove_prefix(3);
+    converter.collect_page_info = page.uses_page_info;
+    converter.compact_ohd = page.compact_ohd;
+    try {
+        page.write_page(converter.page_info, out, [&](Output &out) {converter.to_html(contents, out);});
+    }
+    catch (const Exception &e) {
+        error = e.message + " at line " + std::to_string(e.line) + ", column " + std::to_string(e.column);
+        out.clear();
+        return false;
+    }
+    return true;
+}
+
+// Writes `out` compressed into `path` (`--gzip` option)
+bool write_gzip(GzipEncoder &gzip, int level, const Output &out, const std::string &path)
+{
+    gzip.reset(level);
+    for (auto &&piece : out.get_pieces())
+        gzip.write(piece);
+    gzip.finish();
+    FILE *f = NULL;
+    fopen_s(&f, path.c_str(), "wb");
+    if (f == NULL)
+        return false;
+    bool ok = fwrite(gzip.out.data(), 1, gzip.out.size(), f) == gzip.out.size();
+    return fclose(f) == 0 && ok;
+}
+
+// `gzip_level` is -1 or the compression level of .gz files written next to the output files
+void batch_convert_sync(std::vector<BatchJob> &jobs, const PageTemplate &page, int gzip_level)
+{
+    Converter converter(true);
+    GzipEncoder gzip;
+    Output out;
+    std::string contents;
+    for (auto &&job : jobs) {
+        FILE *f = NULL;
+        fopen_s(&f, job.input_path.c_str(), "rb");
+        if (f == NULL) {
+            job.error = "Can't open file";
+            continue;
+        }
+        contents.clear();
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            contents.append(chunk, n);
+        fclose(f);
+
+        out.clear();
+        if (!batch_convert(converter, page, contents, out, job.error))
+            continue;
+        FILE *outfile = NULL;
+        fopen_s(&outfile, job.output_path.c_str(), "wb");
+        if (outfile == NULL) {
+            job.error = "Can't create file";
+            continue;
+        }
+        if (!out.write_to(outfile) | (fclose(outfile) != 0)) // a buffered write can fail only at `fclose()`
+            job.error = "Can't write file";
+        if (gzip_level >= 0 && job.error.empty() && !write_gzip(gzip, gzip_level, out, job.output_path + ".gz"))
+            job.error = "Can't write file";
+    }
+}
+
+#ifndef _WIN32
+bool read_fd(int fd, std::string &contents)
+{
+    contents.clear();
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        contents.reserve(st.st_size);
+    char chunk[65536];
+    while (true) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n == 0)
+            return true;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        contents.append(chunk, n);
+    }
+}
+
+bool batch_write_output(const BatchJob &job, const Output &out)
+{
+    int fd = ::open(job.output_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1)
+        return false;
+    bool ok = out.write_to(fd);
+    return close(fd) == 0 && ok;
+}
+
+// `threads` workers take files in order while a readahead thread keeps the next `depth` files being read by the kernel
+void batch_convert_threads(std::vector<BatchJob> &jobs, const PageTemplate &page, unsigned threads, unsigned depth, int gzip_level)
+{
+    std::atomic<size_t> next_job(0);
+    std::mutex mutex;
+    std::condition_variable claimed;
+    bool finished = false;
+
+    std::thread readahead([&] {
+        for (size_t r = 0; r < jobs.size(); r++) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                claimed.wait(lock, [&] {return finished || r < next_job + depth;});
+                if (finished)
+                    return;
+            }
+            if (r < next_job) // the file is already being read by a worker
+                continue;
+            int fd = ::open(jobs[r].input_path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd != -1) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+        }
+    });
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++)
+        workers.emplace_back([&] {
+            Converter converter(true);
+            GzipEncoder gzip;
+            Output out;
+            std::string contents;
+            while (true) {
+                size_t j = next_job++;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                }
+                claimed.notify_one();
+                if (j >= jobs.size())
+                    break;
+                BatchJob &job = jobs[j];
+                int fd = ::open(job.input_path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd == -1) {
+                    job.error = "Can't open file";
+                    continue;
+                }
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+                bool ok = read_fd(fd, contents);
+                close(fd);
+                if (!ok) {
+                    job.error = "Can't read file";
+                    continue;
+                }
+                out.clear();
+                if (batch_convert(converter, page, contents, out, job.error)
+                        && (!batch_write_output(job, out) || (gzip_level >= 0 && !write_gzip(gzip, gzip_level, out, job.output_path + ".gz"))))
+                    job.error = "Can't write file";
+            }
+        });
+    for (auto &&w : workers)
+        w.join();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    claimed.notify_one();
+    readahead.join();
+}
+#endif
+
+#ifdef __linux__
+// Minimal io_uring interface over raw system calls (liburing is not required)
+class IoUring
+{
+    int ring_fd = -1;
+    void *sq_ring = MAP_FAILED, *cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, *cq_head, *cq_tail, *cq_mask;
+    io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+    io_uring_cqe *cqes;
+    unsigned sq_entries = 0, queued = 0;
+
+    template <class Ty> Ty *at(void *ring, unsigned offset) {return (Ty*)((char*)ring + offset);}
+
+public:
+    IoUring() = default;
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    bool init(unsigned entries)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if (ring_fd < 0)
+            return false;
+        sq_entries = p.sq_entries;
+        sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            cq_ring = sq_ring;
+        else {
+            cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ring == MAP_FAILED)
+                return false;
+        }
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+        sq_head  = at<unsigned>(sq_ring, p.sq_off.head);
+        sq_tail  = at<unsigned>(sq_ring, p.sq_off.tail);
+        sq_mask  = at<unsigned>(sq_ring, p.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_ring, p.sq_off.array);
+        cq_head  = at<unsigned>(cq_ring, p.cq_off.head);
+        cq_tail  = at<unsigned>(cq_ring, p.cq_off.tail);
+        cq_mask  = at<unsigned>(cq_ring, p.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_ring, p.cq_off.cqes);
+        return true;
+    }
+
+    // Checks that the kernel supports all of the given operations
+    bool supports(std::initializer_list<int> ops)
+    {
+        alignas(io_uring_probe) char buf[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+        io_uring_probe *probe = (io_uring_probe*)buf;
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+            return false;
+        for (int op : ops)
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        return true;
+    }
+
+    bool register_buffers(const iovec *iov, unsigned count)
+    {
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, count) == 0;
+    }
+
+    // Returns a zeroed submission queue entry (submitting queued ones if the queue is full)
+    io_uring_sqe *get_sqe()
+    {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            submit(0);
+            assert(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) < sq_entries);
+        }
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+        return sqe;
+    }
+
+    // Submits queued entries and waits until at least `wait_nr` completions are available
+    bool submit(unsigned wait_nr)
+    {
+        while (true) {
+            long r = syscall(__NR_io_uring_enter, ring_fd, queued, wait_nr, wait_nr != 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (r >= 0) {
+                queued -= (unsigned)r;
+                if (queued == 0 || wait_nr != 0)
+                    return true;
+                continue;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return false;
+        }
+    }
+
+    // Calls `f(user_data, res)` for every available completion
+    template <class F> void for_each_completion(F &&f)
+    {
+        unsigned head = *cq_head;
+        for (; head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE); head++) {
+            io_uring_cqe &cqe = cqes[head & *cq_mask];
+            f(cqe.user_data, cqe.res);
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    ~IoUring()
+    {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (ring_fd >= 0)
+            close(ring_fd);
+    }
+};
+
+// Up to `depth` files are in flight: each of them is opened, read into a registered buffer (or a heap buffer if it does not fit),
+// converted by one of `threads` workers, and written with writev straight from the pieces of its Output.
+// Returns false if io_uring is not available (nothing has been done in this case).
+bool batch_convert_io_uring(std::vector<BatchJob> &jobs, const PageTemplate &page, unsigned threads, unsigned depth, int gzip_level)
+{
+    const size_t fixed_buffer_size = 64 * 1024;
+    enum class Op : unsigned char {OPEN_INPUT, READ, CLOSE, CONVERT, OPEN_OUTPUT, OPEN_GZIP_OUTPUT, WRITE, WAKE_UP};
+
+    IoUring ring;
+    if (!ring.init(depth * 2 + 2) || !ring.supports({IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITEV, IORING_OP_CLOSE}))
+        return false;
+
+    struct Slot
+    {
+        size_t job;
+        Op op;
+        int fd;
+        char *fixed_buffer;
+        std::string heap_buffer; // used when the file does not fit into the fixed buffer
+        size_t size; // number of bytes read or written
+        unsigned requested; // length of the last read
+        bool converted;
+        Output out;
+        std::string gzip_out, gzip_path; // compressed output for `--gzip`
+        bool gzip_next; // the compressed output is written after `out`
+        std::vector<iovec> iov;
+        size_t iov_pos;
+    };
+    std::vector<Slot> slots(depth);
+    std::vector<char> fixed_buffers(fixed_buffer_size * depth);
+    std::vector<iovec> fixed_iov(depth);
+    for (unsigned s = 0; s < depth; s++) {
+        slots[s].fixed_buffer = fixed_buffers.data() + s * fixed_buffer_size;
+        fixed_iov[s] = {slots[s].fixed_buffer, fixed_buffer_size};
+    }
+    bool fixed = ring.register_buffers(fixed_iov.data(), depth); // can fail e.g. because of RLIMIT_MEMLOCK
+
+    auto convert_slot = [&](Converter &converter, GzipEncoder &gzip, unsigned s) {
+        Slot &slot = slots[s];
+        std::string_view contents = slot.heap_buffer.empty() ? std::string_view(slot.fixed_buffer, slot.size) : std::string_view(slot.heap_buffer.data(), slot.size);
+        slot.out.clear();
+        slot.converted = batch_convert(converter, page, contents, slot.out, jobs[slot.job].error);
+        if (slot.converted && gzip_level >= 0) {
+            gzip.reset(gzip_level);
+            for (auto &&piece : slot.out.get_pieces())
+                gzip.write(piece);
+            gzip.finish();
+            slot.gzip_out.swap(gzip.out);
+        }
+    };
+
+    // With more than one thread, conversion runs on worker threads which return converted slots via a queue
+    // and wake up the ring by writing to an eventfd (with one thread files are converted right after they have been read)
+    std::mutex mutex;
+    std::condition_variable to_convert_cv;
+    std::vector<unsigned> to_convert, converted;
+    bool finished = false;
+    int wake_fd = -1;
+    uint64_t wake_value;
+    std::vector<std::thread> workers;
+    Converter inline_converter(true);
+    GzipEncoder inline_gzip;
+    if (threads > 1) {
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if (wake_fd == -1)
+            return false;
+    }
+    for (unsigned t = 0; t < threads && threads > 1; t++)
+        workers.emplace_back([&] {
+            Converter converter(true);
+            GzipEncoder gzip;
+            while (true) {
+                unsigned s;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    to_convert_cv.wait(lock, [&] {return finished || !to_convert.empty();});
+                    if (to_convert.empty())
+                        return;
+                    s = to_convert.back();
+                    to_convert.pop_back();
+                }
+                convert_slot(converter, gzip, s);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    converted.push_back(s);
+                }
+                uint64_t one = 1;
+                while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+            }
+        });
+
+    auto user_data = [](unsigned s, Op op) {return (uint64_t)s << 8 | (uint64_t)op;};
+    auto submit_read = [&](unsigned s) {
+        Slot &slot = slots[s];
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->fd = slot.fd;
+        sqe->off = slot.size;
+        if (slot.heap_buffer.empty() && slot.size < fixed_buffer_size - 1) { // one byte is reserved for the terminating zero
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->addr = (uint64_t)(slot.fixed_buffer + slot.size);
+            sqe->len = unsigned(fixed_buffer_size - 1 - slot.size);
+        }
+        else {
+            if (slot.heap_buffer.empty()) { // the file does not fit into the fixed buffer
+                slot.heap_buffer.assign(slot.fixed_buffer, slot.size);
+                slot.heap_buffer.resize(fixed_buffer_size * 8);
+            }
+            else if (slot.size == slot.heap_buffer.size() - 1)
+                slot.heap_buffer.resize(slot.heap_buffer.size() * 2);
+            sqe->opcode = IORING_OP_READ;
+            sqe->addr = (uint64_t)(slot.heap_buffer.data() + slot.size);
+            sqe->len = unsigned(std::min(slot.heap_buffer.size() - 1 - slot.size, (size_t)1 << 30));
+        }
+        if (sqe->opcode == IORING_OP_READ_FIXED)
+            sqe->buf_index = (unsigned short)s;
+        slot.requested = sqe->len;
+        sqe->user_data = user_data(s, slot.op = Op::READ);
+    };
+    auto submit_write = [&](unsigned s) {
+        Slot &slot = slots[s];
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = slot.fd;
+        sqe->off = slot.size;
+        sqe->addr = (uint64_t)(slot.iov.data() + slot.iov_pos);
+        sqe->len = unsigned(std::min(slot.iov.size() - slot.iov_pos, (size_t)1024)); // IOV_MAX
+        sqe->user_data = user_data(s, slot.op = Op::WRITE);
+    };
+    auto submit_open = [&](unsigned s, const std::string &path, int flags, Op op) {
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)path.c_str();
+        sqe->open_flags = flags | O_CLOEXEC;
+        sqe->len = 0666; // mode
+        sqe->user_data = user_data(s, slots[s].op = op);
+    };
+    auto submit_close = [&](unsigned s) { // completion of close is not waited for
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = slots[s].fd;
+        sqe->user_data = user_data(s, Op::CLOSE);
+    };
+    auto submit_wake_up_read = [&] {
+        io_uring_sqe *sqe = ring.get_sqe();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = (uint64_t)&wake_value;
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = user_data(0, Op::WAKE_UP);
+    };
+
+    size_t next_job = 0, done = 0;
+    std::vector<unsigned> free_slots;
+    for (unsigned s = depth; s-- > 0;)
+        free_slots.push_back(s);
+    std::vector<char> job_done(jobs.size(), false);
+    auto finish_job = [&](unsigned s, const char *error) {
+        if (error != NULL)
+            jobs[slots[s].job].error = error;
+        job_done[slots[s].job] = true;
+        done++;
+        free_slots.push_back(s);
+    };
+
+    auto converted_slot = [&](unsigned s) {
+        Slot &slot = slots[s];
+        if (!slot.converted)
+            return finish_job(s, NULL); // the error is already set by batch_convert()
+        slot.gzip_next = gzip_level >= 0;
+        if (slot.gzip_next)
+            slot.gzip_path = jobs[slot.job].output_path + ".gz";
+        submit_open(s, jobs[slot.job].output_path, O_WRONLY | O_CREAT | O_TRUNC, Op::OPEN_OUTPUT);
+    };
+    auto written = [&](unsigned s) {
+        submit_close(s);
+        if (!slots[s].gzip_next)
+            return finish_job(s, NULL);
+        slots[s].gzip_next = false;
+        submit_open(s, slots[s].gzip_path, O_WRONLY | O_CREAT | O_TRUNC, Op::OPEN_GZIP_OUTPUT);
+    };
+
+    if (!workers.empty())
+        submit_wake_up_read();
+    bool ok = true;
+    while (done < jobs.size()) {
+        while (!free_slots.empty() && next_job < jobs.size()) {
+            unsigned s = free_slots.back();
+            free_slots.pop_back();
+            Slot &slot = slots[s];
+            slot.job = next_job++;
+            slot.size = 0;
+            slot.heap_buffer.clear();
+            submit_open(s, jobs[slot.job].input_path, O_RDONLY, Op::OPEN_INPUT);
+        }
+        if (!ring.submit(1)) {
+            ok = false;
+            break;
+        }
+        ring.for_each_completion([&](uint64_t data, int res) {
+            unsigned s = unsigned(data >> 8);
+            Slot &slot = slots[s];
+            switch ((Op)(data & 0xFF)) {
+            case Op::OPEN_INPUT:
+                if (res < 0)
+                    return finish_job(s, "Can't open file");
+                slot.fd = res;
+                return submit_read(s);
+            case Op::READ:
+                if (res < 0) {
+                    submit_close(s);
+                    return finish_job(s, "Can't read file");
+                }
+                slot.size += res;
+                if (res > 0 && (unsigned)res == slot.requested)
+                    return submit_read(s);
+                // A short read of a regular file means the end of the file
+                submit_close(s);
+                (slot.heap_buffer.empty() ? slot.fixed_buffer : &slot.heap_buffer[0])[slot.size] = '\0'; // like after the contents of a std::string
+                if (workers.empty()) {
+                    convert_slot(inline_converter, inline_gzip, s);
+                    return converted_slot(s);
+                }
+                slot.op = Op::CONVERT;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    to_convert.push_back(s);
+                }
+                to_convert_cv.notify_one();
+                return;
+            case Op::OPEN_OUTPUT:
+            case Op::OPEN_GZIP_OUTPUT:
+                if (res < 0)
+                    return finish_job(s, "Can't create file");
+                slot.fd = res;
+                slot.size = 0;
+                slot.iov.clear();
+                if ((Op)(data & 0xFF) == Op::OPEN_GZIP_OUTPUT)
+                    slot.iov.push_back({&slot.gzip_out[0], slot.gzip_out.length()});
+                else
+                    for (auto &&piece : slot.out.get_pieces())
+                        if (!piece.empty()) // an empty iovec at the end would make writev() return 0
+                            slot.iov.push_back({const_cast<char*>(piece.data()), piece.length()});
+                slot.iov_pos = 0;
+                if (slot.iov.empty())
+                    return written(s);
+                return submit_write(s);
+            case Op::WRITE:
+                if (res <= 0) {
+                    submit_close(s);
+                    return finish_job(s, "Can't write file");
+                }
+                slot.size += res;
+                while (res > 0) { // skip written pieces
+                    iovec &v = slot.iov[slot.iov_pos];
+                    if ((size_t)res < v.iov_len) {
+                        v.iov_base = (char*)v.iov_base + res;
+                        v.iov_len -= res;
+                        break;
+                    }
+                    res -= (int)v.iov_len;
+                    slot.iov_pos++;
+                }
+                if (slot.iov_pos < slot.iov.size())
+                    return submit_write(s);
+                return written(s);
+            case Op::WAKE_UP: {
+                std::vector<unsigned> ready;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready.swap(converted);
+                }
+                for (unsigned c : ready)
+                    converted_slot(c);
+                return submit_wake_up_read();
+            }
+            case Op::CLOSE:
+            case Op::CONVERT:
+                return;
+            }
+        });
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    to_convert_cv.notify_all();
+    for (auto &&w : workers)
+        w.join();
+    if (wake_fd != -1)
+        close(wake_fd);
+    if (!ok)
+        for (size_t j = 0; j < jobs.size(); j++)
+            if (!job_done[j] && jobs[j].error.empty())
+                jobs[j].error = "Input/output error";
+    return true;
+}
+#endif
+
+// `--gzip` or `--gzip=level`
+int parse_gzip_level(const std::string &arg)
+{
+    return arg.length() > 7 ? std::min(std::max(atoi(arg.c_str() + 7), 0), 9) : 6;
+}
+
+struct BatchOptions
+{
+    std::string io =
+#ifdef __linux__
+        "uring";
+#elif !defined(_WIN32)
+        "threads";
+#else
+        "sync";
+#endif
+    unsigned threads = std::max(std::thread::hardware_concurrency(), 1u), depth = 64;
+    std::string template_file;
+    int gzip_level = -1; // -1 if .gz files are not written
+    bool compact_ohd = false;
+
+    // Consumes the option at `argv[a]` (and its value) if it is one of the options of batch conversion
+    bool parse(int argc, char *argv[], int &a)
+    {
+        std::string arg = argv[a];
+        if (arg.compare(0, 5, "--io=") == 0)
+            io = arg.substr(5);
+        else if (arg == "-j" && a + 1 < argc)
+            threads = std::max(atoi(argv[++a]), 1);
+        else if (arg == "--depth" && a + 1 < argc)
+            depth = std::max(atoi(argv[++a]), 1);
+        else if (arg == "--template" && a + 1 < argc)
+            template_file = argv[++a];
+        else if (arg.compare(0, 6, "--gzip") == 0 && (arg.length() == 6 || arg[6] == '='))
+            gzip_level = parse_gzip_level(arg);
+        else if (arg == "--compact")
+            compact_ohd = true;
+        else
+            return false;
+        return true;
+    }
+};
+
+bool run_batch(std::vector<BatchJob> &jobs, const PageTemplate &page, const BatchOptions &options)
+{
+    if (options.io == "sync")
+        batch_convert_sync(jobs, page, options.gzip_level);
+#ifndef _WIN32
+    else if (options.io == "threads")
+        batch_convert_threads(jobs, page, std::max(options.threads, options.depth / 4), options.depth, options.gzip_level); // more threads than CPUs to keep several reads in flight
+#ifdef __linux__
+    else if (options.io == "uring") {
+        if (!batch_convert_io_uring(jobs, page, options.threads, options.depth, options.gzip_level))
+            batch_convert_threads(jobs, page, std::max(options.threads, options.depth / 4), options.depth, options.gzip_level);
+    }
+#endif
+#endif
+    else {
+        std::cerr << "Unsupported I/O method '" << options.io << "'\n";
+        return false;
+    }
+    return true;
+}
+
+// `pqmarkup_lite --batch [--io=uring|threads|sync] [-j threads] [--depth files-in-flight] [--template file] input-files...`
+// (input-file `-` reads the list of files from standard input, one per line)
+int batch_main(int argc, char *argv[])
+{
+    BatchOptions options;
+    std::vector<BatchJob> jobs;
+    auto add_job = [&jobs](const std::string &path) {
+        jobs.push_back({path, batch_output_path(path), std::string()});
+    };
+    for (int a = 0; a < argc; a++) {
+        if (options.parse(argc, argv, a))
+            continue;
+        if (strcmp(argv[a], "-") == 0) {
+            std::string line;
+            while (std::getline(std::cin, line))
+                if (!line.empty())
+                    add_job(line);
+        }
+        else
+            add_job(argv[a]);
+    }
+
+    PageTemplate page;
+    std::string error;
+    if (!options.template_file.empty() && !page.load(options.template_file, error)) {
+        std::cerr << error << "\n";
+        return -1;
+    }
+    if (options.compact_ohd)
+        page.set_compact_ohd();
+    if (!run_batch(jobs, page, options))
+        return -1;
+
+    int result = 0;
+    for (auto &&job : jobs)
+        if (!job.error.empty()) {
+            std::cerr << job.input_path << ": " << job.error << "\n";
+            result = -1;
+        }
+    return result;
+}
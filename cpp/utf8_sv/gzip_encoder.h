@@ -0,0 +1,518 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <iterator>
+#include <stdint.h>
+#include <string.h>
+
+// Gzip (RFC 1951 and RFC 1952) encoder of a stream: data is passed by `write()` in pieces of any size and `finish()` completes
+// the stream. The compressed data is appended to `out`, which can be taken away at any time. Matches are found with hash chains
+// over a 32 KB window (searched deeper and with lazy matching at higher levels), every block gets its own Huffman codes
+// unless fixed codes or storing are cheaper for it, and level 0 only stores the data.
+class GzipEncoder
+{
+    enum {WINDOW = 32768, MIN_MATCH = 3, MAX_MATCH = 258, HASH_BITS = 15, MAX_SYMBOLS = 32768, CHUNK = 128 * 1024};
+    int level = 6, max_chain = 128, nice_length = 128;
+    bool lazy = true;
+    std::string buf; // the window and then the data not yet compressed
+    size_t pos = 0, inserted = 0; // position of the first byte not yet compressed and of the first byte not yet in the hash chains
+    std::vector<int> head, prev;
+    std::vector<uint32_t> symbols; // `dist << 9 | len` for a match or a literal byte with `dist` equal to 0
+    uint32_t lit_freq[286], dist_freq[30];
+    uint64_t bit_buf = 0;
+    int bit_count = 0;
+    uint32_t crc = 0, input_size = 0;
+    bool header_written = false;
+
+    struct Tables
+    {
+        uint8_t len_code[MAX_MATCH + 1], dist_code[512];
+        uint16_t len_base[29], dist_base[30];
+        uint8_t len_extra[29], dist_extra[30];
+        uint8_t fixed_lit_len[288], fixed_dist_len[30];
+        uint16_t fixed_lit_code[288], fixed_dist_code[30];
+        uint32_t crc[256];
+
+        Tables()
+        {
+            for (int c = 0, len = 3; c < 29; c++) {
+                len_extra[c] = c < 8 || c == 28 ? 0 : uint8_t((c - 4) / 4);
+                len_base[c] = c == 28 ? 258 : (uint16_t)len;
+                for (int i = 0; i < 1 << len_extra[c] && len + i <= MAX_MATCH; i++)
+                    len_code[len + i] = (uint8_t)c;
+                len += 1 << len_extra[c];
+            }
+            len_code[MAX_MATCH] = 28;
+            for (int c = 0, dist = 1; c < 30; c++) {
+                dist_extra[c] = c < 4 ? 0 : uint8_t((c - 2) / 2);
+                dist_base[c] = (uint16_t)dist;
+                for (int i = 0; i < 1 << dist_extra[c]; i++) { // `dist_code[d - 1]` for d <= 256 and `dist_code[256 + ((d - 1) >> 7)]`
+                    int d = dist + i - 1;
+                    if (d < 256)
+                        dist_code[d] = (uint8_t)c;
+                    else if ((d & 127) == 0)
+                        dist_code[256 + (d >> 7)] = (uint8_t)c;
+                }
+                dist += 1 << dist_extra[c];
+            }
+            for (int s = 0; s < 288; s++)
+                fixed_lit_len[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+            for (int s = 0; s < 30; s++)
+                fixed_dist_len[s] = 5;
+            huffman_codes(fixed_lit_len, 288, fixed_lit_code);
+            huffman_codes(fixed_dist_len, 30, fixed_dist_code);
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; k++)
+                    c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                crc[i] = c;
+            }
+        }
+    };
+    static const Tables &tables()
+    {
+        static const Tables t;
+        return t;
+    }
+    static int dist_code(const Tables &t, int dist) {return t.dist_code[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];}
+
+    // Computes lengths (at most `max_len` bits) of a Huffman code for symbols with frequencies `freq` (zero for unused symbols)
+    static void huffman_lengths(const uint32_t *freq, int n, int max_len, uint8_t *lengths)
+    {
+        int syms[288], m = 0;
+        uint32_t a[288];
+        for (int s = 0; s < n; s++) {
+            lengths[s] = 0;
+            if (freq[s] != 0)
+                syms[m++] = s;
+        }
+        if (m < 2) {
+            if (m == 1)
+                lengths[syms[0]] = 1;
+            return;
+        }
+        std::sort(syms, syms + m, [freq](int x, int y) {return freq[x] < freq[y] || (freq[x] == freq[y] && x < y);});
+        for (int i = 0; i < m; i++)
+            a[i] = freq[syms[i]];
+
+        // In-place computation of minimum-redundancy code lengths [Moffat and Katajainen, 1995]
+        int root = 0, leaf = 2, next;
+        a[0] += a[1];
+        for (next = 1; next < m - 1; next++) {
+            if (leaf >= m || a[root] < a[leaf]) {
+                a[next] = a[root];
+                a[root++] = next;
+            }
+            else
+                a[next] = a[leaf++];
+            if (leaf >= m || (root < next && a[root] < a[leaf])) {
+                a[next] += a[root];
+                a[root++] = next;
+            }
+            else
+                a[next] += a[leaf++];
+        }
+        a[m - 2] = 0;
+        for (next = m - 3; next >= 0; next--)
+            a[next] = a[a[next]] + 1;
+        int avbl = 1, used = 0, depth = 0;
+        root = m - 2;
+        next = m - 1;
+        while (avbl > 0) {
+            while (root >= 0 && (int)a[root] == depth) {
+                used++;
+                root--;
+            }
+            while (avbl > used) {
+                a[next--] = depth;
+                avbl--;
+            }
+            avbl = 2 * used;
+            depth++;
+            used = 0;
+        }
+
+        // Limit the lengths keeping the code complete, then give the longest codes to the least frequent symbols
+        int count[32] = {};
+        for (int i = 0; i < m; i++)
+            count[std::min((int)a[i], max_len)]++;
+        uint32_t total = 0;
+        for (int l = max_len; l > 0; l--)
+            total += (uint32_t)count[l] << (max_len - l);
+        for (; total > 1u << max_len; total--) {
+            count[max_len]--;
+            for (int l = max_len - 1; l > 0; l--)
+                if (count[l] != 0) {
+                    count[l]--;
+                    count[l + 1] += 2;
+                    break;
+                }
+        }
+        for (int l = max_len, i = 0; l > 0; l--)
+            for (int c = 0; c < count[l]; c++)
+                lengths[syms[i++]] = (uint8_t)l;
+    }
+
+    // Assigns canonical codes (bit-reversed, as Huffman codes are packed starting with their most significant bit)
+    static void huffman_codes(const uint8_t *lengths, int n, uint16_t *codes)
+    {
+        int count[16] = {}, next[16];
+        for (int s = 0; s < n; s++)
+            count[lengths[s]]++;
+        count[0] = 0;
+        for (int l = 1, code = 0; l < 16; l++)
+            next[l] = code = (code + count[l - 1]) << 1;
+        for (int s = 0; s < n; s++)
+            if (lengths[s] != 0) {
+                uint32_t c = next[lengths[s]]++, r = 0;
+                for (int b = 0; b < lengths[s]; b++, c >>= 1)
+                    r = r << 1 | (c & 1);
+                codes[s] = (uint16_t)r;
+            }
+    }
+
+    void put_bits(uint32_t bits, int n)
+    {
+        bit_buf |= (uint64_t)bits << bit_count;
+        bit_count += n;
+        if (bit_count >= 32) {
+            char b[4] = {char(bit_buf), char(bit_buf >> 8), char(bit_buf >> 16), char(bit_buf >> 24)};
+            out.append(b, 4);
+            bit_buf >>= 32;
+            bit_count -= 32;
+        }
+    }
+
+    void align_to_byte()
+    {
+        for (; bit_count > 0; bit_count -= 8, bit_buf >>= 8)
+            out += char(bit_buf);
+        bit_count = 0;
+        bit_buf = 0;
+    }
+
+    void put_le32(uint32_t v)
+    {
+        char b[4] = {char(v), char(v >> 8), char(v >> 16), char(v >> 24)};
+        out.append(b, 4);
+    }
+
+    uint32_t hash(size_t p) const
+    {
+        uint32_t v = (uint8_t)buf[p] | (uint8_t)buf[p + 1] << 8 | (uint8_t)buf[p + 2] << 16;
+        return (v * 2654435761u) >> (32 - HASH_BITS);
+    }
+
+    // Adds positions before `end` to the hash chains
+    void insert_before(size_t end)
+    {
+        for (; inserted < end && inserted + MIN_MATCH <= buf.length(); inserted++) {
+            uint32_t h = hash(inserted);
+            prev[inserted & (WINDOW - 1)] = head[h];
+            head[h] = (int)inserted;
+        }
+    }
+
+    // Returns the length of the longest match for the data at `p` (0 if it is shorter than MIN_MATCH)
+    int find_match(size_t p, int &dist) const
+    {
+        int end_len = (int)std::min((size_t)MAX_MATCH, buf.length() - p), best = MIN_MATCH - 1;
+        if (end_len < MIN_MATCH)
+            return 0;
+        const char *s = buf.data() + p;
+        int chain = max_chain;
+        for (int c = head[hash(p)]; c >= 0 && p - c <= WINDOW && chain-- > 0;) {
+            const char *m = buf.data() + c;
+            if (m[best] == s[best] && m[0] == s[0] && m[1] == s[1]) {
+                int len = 0;
+                for (uint64_t x, y; len + 8 <= end_len; len += 8) {
+                    memcpy(&x, m + len, 8);
+                    memcpy(&y, s + len, 8);
+                    if (x != y)
+                        break;
+                }
+                while (len < end_len && m[len] == s[len])
+                    len++;
+                if (len > best) {
+                    best = len;
+                    dist = int(p - c);
+                    if (len >= nice_length || len == end_len)
+                        break;
+                }
+            }
+            int next = prev[c & (WINDOW - 1)];
+            if (next >= c) // the slot has been reused by a newer position
+                break;
+            c = next;
+        }
+        if (best == MIN_MATCH && dist > 4096) // not worth it
+            return 0;
+        return best >= MIN_MATCH ? best : 0;
+    }
+
+    void add_literal(size_t p)
+    {
+        symbols.push_back((uint8_t)buf[p]);
+        lit_freq[(uint8_t)buf[p]]++;
+    }
+
+    void add_match(int len, int dist)
+    {
+        const Tables &t = tables();
+        symbols.push_back((uint32_t)dist << 9 | len);
+        lit_freq[257 + t.len_code[len]]++;
+        dist_freq[dist_code(t, dist)]++;
+    }
+
+    void write_stored(size_t start, size_t end, bool final)
+    {
+        do {
+            size_t n = std::min(end - start, (size_t)65535);
+            put_bits(final && start + n == end ? 1 : 0, 3);
+            align_to_byte();
+            char b[4] = {char(n), char(n >> 8), char(~n), char(~n >> 8)};
+            out.append(b, 4);
+            out.append(buf, start, n);
+            start += n;
+        } while (start < end);
+    }
+
+    // Writes `symbols` (covering data [`start`, `end`) of `buf`) as a block with dynamic or fixed Huffman codes, or stores the data
+    void write_block(size_t start, size_t end, bool final)
+    {
+        const Tables &t = tables();
+        lit_freq[256] = 1; // end of block
+        uint8_t lit_len[286], dist_len[30];
+        uint16_t lit_code[286], dist_code_[30];
+        if (std::all_of(dist_freq, dist_freq + 30, [](uint32_t f) {return f == 0;}))
+            dist_freq[0] = 1; // at least one distance code is expected by some decoders
+        huffman_lengths(lit_freq, 286, 15, lit_len);
+        huffman_lengths(dist_freq, 30, 15, dist_len);
+        int hlit = 286, hdist = 30;
+        while (hlit > 257 && lit_len[hlit - 1] == 0)
+            hlit--;
+        while (hdist > 1 && dist_len[hdist - 1] == 0)
+            hdist--;
+
+        // Run-length encoding of the code lengths
+        uint8_t lens[286 + 30], cl_syms[286 + 30], cl_extra[286 + 30];
+        int n = 0, ncl = 0;
+        for (int s = 0; s < hlit; s++)
+            lens[n++] = lit_len[s];
+        for (int s = 0; s < hdist; s++)
+            lens[n++] = dist_len[s];
+        uint32_t cl_freq[19] = {};
+        auto add_cl = [&](int sym, int extra) {
+            cl_syms[ncl] = (uint8_t)sym;
+            cl_extra[ncl++] = (uint8_t)extra;
+            cl_freq[sym]++;
+        };
+        for (int i = 0; i < n;) {
+            int run = 1;
+            while (i + run < n && lens[i + run] == lens[i])
+                run++;
+            int left = run;
+            if (lens[i] == 0)
+                while (left >= 3) {
+                    int r = std::min(left, 138);
+                    if (r >= 11)
+                        add_cl(18, r - 11);
+                    else
+                        add_cl(17, r - 3);
+                    left -= r;
+                }
+            else {
+                add_cl(lens[i], 0);
+                left--;
+                while (left >= 3) {
+                    int r = std::min(left, 6);
+                    add_cl(16, r - 3);
+                    left -= r;
+                }
+            }
+            for (; left > 0; left--)
+                add_cl(lens[i], 0);
+            i += run;
+        }
+        static const uint8_t cl_order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        uint8_t cl_len[19];
+        uint16_t cl_code[19];
+        huffman_lengths(cl_freq, 19, 7, cl_len);
+        int hclen = 19;
+        while (hclen > 4 && cl_len[cl_order[hclen - 1]] == 0)
+            hclen--;
+
+        // Sizes of the block in bits with dynamic and fixed codes and stored
+        uint64_t extra_bits = 0, dynamic_bits = 3 + 14 + 3 * hclen, fixed_bits = 3;
+        for (int s = 0; s < 286; s++) {
+            dynamic_bits += (uint64_t)lit_freq[s] * lit_len[s];
+            fixed_bits += (uint64_t)lit_freq[s] * t.fixed_lit_len[s];
+            if (s >= 257)
+                extra_bits += (uint64_t)lit_freq[s] * t.len_extra[s - 257];
+        }
+        for (int s = 0; s < 30; s++) {
+            dynamic_bits += (uint64_t)dist_freq[s] * dist_len[s];
+            fixed_bits += (uint64_t)dist_freq[s] * t.fixed_dist_len[s];
+            extra_bits += (uint64_t)dist_freq[s] * t.dist_extra[s];
+        }
+        for (int s = 0; s < 19; s++)
+            dynamic_bits += (uint64_t)cl_freq[s] * cl_len[s];
+        dynamic_bits += 2 * cl_freq[16] + 3 * cl_freq[17] + 7 * cl_freq[18] + extra_bits;
+        fixed_bits += extra_bits;
+        uint64_t stored_bits = (end - start + 5 * ((end - start) / 65535 + 1)) * 8 + 7;
+
+        if (stored_bits <= std::min(dynamic_bits, fixed_bits))
+            write_stored(start, end, final);
+        else {
+            const uint8_t *ll = lit_len, *dl = dist_len;
+            const uint16_t *lc = lit_code, *dc = dist_code_;
+            if (fixed_bits <= dynamic_bits) {
+                put_bits(final ? 3 : 2, 3);
+                ll = t.fixed_lit_len;
+                dl = t.fixed_dist_len;
+                lc = t.fixed_lit_code;
+                dc = t.fixed_dist_code;
+            }
+            else {
+                put_bits(final ? 5 : 4, 3);
+                put_bits(hlit - 257, 5);
+                put_bits(hdist - 1, 5);
+                put_bits(hclen - 4, 4);
+                for (int i = 0; i < hclen; i++)
+                    put_bits(cl_len[cl_order[i]], 3);
+                huffman_codes(cl_len, 19, cl_code);
+                for (int i = 0; i < ncl; i++) {
+                    put_bits(cl_code[cl_syms[i]], cl_len[cl_syms[i]]);
+                    if (cl_syms[i] >= 16)
+                        put_bits(cl_extra[i], cl_syms[i] == 16 ? 2 : cl_syms[i] == 17 ? 3 : 7);
+                }
+                huffman_codes(lit_len, 286, lit_code);
+                huffman_codes(dist_len, 30, dist_code_);
+            }
+            for (uint32_t sym : symbols) {
+                int dist = sym >> 9, len = sym & 511;
+                if (dist == 0) {
+                    put_bits(lc[len], ll[len]);
+                    continue;
+                }
+                int c = t.len_code[len];
+                put_bits(lc[257 + c], ll[257 + c]);
+                put_bits(len - t.len_base[c], t.len_extra[c]);
+                c = dist_code(t, dist);
+                put_bits(dc[c], dl[c]);
+                put_bits(dist - t.dist_base[c], t.dist_extra[c]);
+            }
+            put_bits(lc[256], ll[256]);
+        }
+        symbols.clear();
+        std::fill(std::begin(lit_freq), std::end(lit_freq), 0);
+        std::fill(std::begin(dist_freq), std::end(dist_freq), 0);
+    }
+
+    // Compresses the data after `pos` (leaving the last MAX_MATCH bytes for later unless `final`)
+    void compress(bool final)
+    {
+        if (!header_written) {
+            const char header[10] = {'\x1F', '\x8B', 8, 0, 0, 0, 0, 0, char(level == 9 ? 2 : level == 1 ? 4 : 0), 3};
+            out.append(header, 10);
+            header_written = true;
+        }
+        size_t limit = final ? buf.length() : buf.length() - MAX_MATCH, block_start = pos;
+        if (level == 0) {
+            if (limit > pos || final)
+                write_stored(pos, limit, final);
+            pos = limit;
+        }
+        else {
+            while (pos < limit) {
+                insert_before(pos);
+                int dist = 0, len = find_match(pos, dist);
+                if (lazy && len != 0 && len < nice_length && pos + 1 < limit) {
+                    insert_before(pos + 1);
+                    int dist2 = 0, len2 = find_match(pos + 1, dist2);
+                    if (len2 > len) {
+                        add_literal(pos++);
+                        len = len2;
+                        dist = dist2;
+                    }
+                }
+                if (len != 0) {
+                    add_match(len, dist);
+                    pos += len;
+                }
+                else
+                    add_literal(pos++);
+                if (symbols.size() >= MAX_SYMBOLS) {
+                    write_block(block_start, pos, false);
+                    block_start = pos;
+                }
+            }
+            if (!symbols.empty() || final)
+                write_block(block_start, pos, final);
+        }
+
+        // Keep only the window before `pos`
+        if (pos > WINDOW) {
+            size_t shift = pos - WINDOW;
+            buf.erase(0, shift);
+            pos -= shift;
+            inserted -= shift;
+            for (int &h : head)
+                h = h >= (int)shift ? h - (int)shift : -1;
+            for (int &p : prev)
+                p = p >= (int)shift ? p - (int)shift : -1;
+        }
+    }
+
+public:
+    std::string out;
+
+    explicit GzipEncoder(int level = 6) {reset(level);}
+
+    // Starts a new stream (`out` is cleared too)
+    void reset(int level)
+    {
+        static const struct {int max_chain, nice_length; bool lazy;} levels[10] = {
+            {0, 0, false}, {4, 8, false}, {8, 16, false}, {16, 32, false}, {16, 32, true},
+            {32, 64, true}, {128, 128, true}, {256, 258, true}, {1024, 258, true}, {4096, 258, true}};
+        this->level = std::min(std::max(level, 0), 9);
+        max_chain = levels[this->level].max_chain;
+        nice_length = levels[this->level].nice_length;
+        lazy = levels[this->level].lazy;
+        buf.clear();
+        pos = inserted = 0;
+        head.assign(1 << HASH_BITS, -1);
+        prev.assign(WINDOW, -1);
+        symbols.clear();
+        std::fill(std::begin(lit_freq), std::end(lit_freq), 0);
+        std::fill(std::begin(dist_freq), std::end(dist_freq), 0);
+        bit_buf = 0;
+        bit_count = 0;
+        crc = input_size = 0;
+        header_written = false;
+        out.clear();
+    }
+
+    void write(std::string_view data)
+    {
+        const Tables &t = tables();
+        uint32_t c = ~crc;
+        for (unsigned char b : data)
+            c = t.crc[(c ^ b) & 0xFF] ^ (c >> 8);
+        crc = ~c;
+        input_size += (uint32_t)data.length();
+        buf.append(data);
+        if (buf.length() - pos >= CHUNK + MAX_MATCH)
+            compress(false);
+    }
+
+    void finish()
+    {
+        compress(true);
+        align_to_byte();
+        put_le32(crc);
+        put_le32(input_size);
+    }
+};
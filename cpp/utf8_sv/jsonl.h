@@ -0,0 +1,305 @@
+#pragma once
+// This is a part of utf8_sv.cpp, which includes it after the engine and batch.h (`--jsonl` takes the options of `--batch`).
+
+// JSONL conversion (`--jsonl`): every line of the input is a JSON object like {"id": ..., "text": ...}, for which a line
+// {"id": ..., "html": ...} or {"id": ..., "error": ..., "line": ..., "column": ...} is written (in the same order).
+// The value of "id" is copied as is. Strings without escape sequences are converted in place and the output is escaped
+// directly from the pieces of Output, so a document is not copied on its way through.
+
+// Returns the position after the JSON value starting at `s[p]` or npos if there is no valid value there (values are checked
+// only as far as it is needed to find their ends)
+size_t json_value_end(std::string_view s, size_t p)
+{
+    if (p >= s.length())
+        return std::string_view::npos;
+    if (s[p] == '"') {
+        for (p++; p < s.length(); p++)
+            if (s[p] == '\\')
+                p++;
+            else if (s[p] == '"')
+                return p + 1;
+        return std::string_view::npos;
+    }
+    if (s[p] == '{' || s[p] == '[') {
+        size_t depth = 0;
+        while (p < s.length()) {
+            if (s[p] == '"') {
+                p = json_value_end(s, p);
+                if (p == std::string_view::npos)
+                    return p;
+                continue;
+            }
+            if (s[p] == '{' || s[p] == '[')
+                depth++;
+            else if ((s[p] == '}' || s[p] == ']') && --depth == 0)
+                return p + 1;
+            p++;
+        }
+        return std::string_view::npos;
+    }
+    size_t start = p;
+    while (p < s.length() && (isalnum((unsigned char)s[p]) || in(s[p], "+-.")))
+        p++;
+    return p > start ? p : std::string_view::npos;
+}
+
+size_t json_skip_spaces(std::string_view s, size_t p)
+{
+    while (p < s.length() && in(s[p], " \t\r\n"))
+        p++;
+    return p;
+}
+
+// Decodes the contents of a JSON string (without quotes) into `out`, returns false on an invalid escape sequence
+bool json_unescape(std::string_view s, std::string &out)
+{
+    out.clear();
+    auto hex4 = [&s](size_t p, unsigned &c) {
+        if (p + 4 > s.length())
+            return false;
+        c = 0;
+        for (size_t i = p; i < p + 4; i++) {
+            if (!isxdigit((unsigned char)s[i]))
+                return false;
+            c = c * 16 + (isdigit((unsigned char)s[i]) ? s[i] - '0' : (s[i] | 0x20) - 'a' + 10);
+        }
+        return true;
+    };
+    for (size_t i = 0; i < s.length(); i++) {
+        if (s[i] != '\\') {
+            out += s[i];
+            continue;
+        }
+        if (++i == s.length())
+            return false;
+        unsigned c;
+        switch (s[i])
+        {
+        case '"': case '\\': case '/': out += s[i]; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u':
+            if (!hex4(i + 1, c))
+                return false;
+            i += 4;
+            if (c >= 0xD800 && c < 0xDC00) { // a surrogate pair
+                unsigned low;
+                if (i + 2 >= s.length() || s[i + 1] != '\\' || s[i + 2] != 'u' || !hex4(i + 3, low) || low < 0xDC00 || low >= 0xE000)
+                    return false;
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 6;
+            }
+            if (c < 0x80)
+                out += char(c);
+            else if (c < 0x800) {
+                out += char(0xC0 | c >> 6);
+                out += char(0x80 | (c & 0x3F));
+            }
+            else if (c < 0x10000) {
+                out += char(0xE0 | c >> 12);
+                out += char(0x80 | (c >> 6 & 0x3F));
+                out += char(0x80 | (c & 0x3F));
+            }
+            else {
+                out += char(0xF0 | c >> 18);
+                out += char(0x80 | (c >> 12 & 0x3F));
+                out += char(0x80 | (c >> 6 & 0x3F));
+                out += char(0x80 | (c & 0x3F));
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+// Converts one line of JSONL input appending the resulting line to `json`. `text` is a buffer for a "text" with escape sequences.
+// Returns false if the line has an error.
+bool jsonl_convert_line(std::string_view line, Converter &converter, Output &out, std::string &text, std::string &json)
+{
+    std::string_view id = "null", text_value;
+    bool valid = false;
+    size_t p = json_skip_spaces(line, 0);
+    if (p < line.length() && line[p] == '{') {
+        p = json_skip_spaces(line, p + 1);
+        if (p < line.length() && line[p] == '}')
+            valid = json_skip_spaces(line, p + 1) == line.length();
+        while (p < line.length() && line[p] == '"') {
+            size_t key_end = json_value_end(line, p);
+            if (key_end == std::string_view::npos)
+                break;
+            std::string_view key = line.substr(p + 1, key_end - p - 2);
+            p = json_skip_spaces(line, key_end);
+            if (p == line.length() || line[p] != ':')
+                break;
+            p = json_skip_spaces(line, p + 1);
+            size_t value_end = json_value_end(line, p);
+            if (value_end == std::string_view::npos)
+                break;
+            if (key == "id")
+                id = line.substr(p, value_end - p);
+            else if (key == "text")
+                text_value = line.substr(p, value_end - p);
+            p = json_skip_spaces(line, value_end);
+            if (p < line.length() && line[p] == ',')
+                p = json_skip_spaces(line, p + 1);
+            else {
+                valid = p < line.length() && line[p] == '}' && json_skip_spaces(line, p + 1) == line.length();
+                break;
+            }
+        }
+    }
+
+    json += "{\"id\": ";
+    json += id;
+    std::string_view error;
+    if (!valid)
+        error = "Invalid JSON";
+    else if (text_value.empty() || text_value[0] != '"')
+        error = "No \"text\" string";
+    else {
+        std::string_view doc = text_value.substr(1, text_value.length() - 2);
+        if (doc.find('\\') != std::string_view::npos) {
+            if (!json_unescape(doc, text))
+                error = "Invalid JSON";
+            doc = text;
+        }
+        if (error.empty()) {
+            out.clear();
+            try {
+                converter.to_html(doc, out);
+                json += ", \"html\": \"";
+                out.for_each_piece([&json](std::string_view piece) {append_json_escaped(json, piece);});
+                json += "\"}\n";
+                return true;
+            }
+            catch (const Exception &e) {
+                json += ", \"error\": ";
+                append_json_string(json, e.message);
+                json += ", \"line\": " + std::to_string(e.line) + ", \"column\": " + std::to_string(e.column) + "}\n";
+                return false;
+            }
+        }
+    }
+    json += ", \"error\": ";
+    append_json_string(json, error);
+    json += "}\n";
+    return false;
+}
+
+// Converts JSONL from `in` to `out` with `threads` converting threads. The input is cut into batches of whole lines of about
+// `batch_size` bytes, which pass through a ring of slots: the reading thread (the calling one) fills a slot, a converting thread
+// converts it and the writing thread writes it out and frees the slot. Instead of locks each slot has a stamp which tells
+// which batch it holds and at which stage: 3 * n (free for batch n), 3 * n + 1 (batch n is read), 3 * n + 2 (it is converted).
+// Threads claim batches in order through an atomic counter, so the output is in the order of the input.
+// Returns false if some line has an error.
+bool jsonl_convert(FILE *in, FILE *out, unsigned threads, bool compact_ohd = false, size_t batch_size = 64*1024)
+{
+    struct Batch
+    {
+        std::atomic<size_t> stamp;
+        std::string input, output;
+    };
+    const size_t ring_size = 4 * (size_t)threads;
+    std::vector<Batch> ring(ring_size);
+    for (size_t s = 0; s < ring_size; s++)
+        ring[s].stamp = 3 * s;
+    std::atomic<size_t> batches_count(SIZE_MAX), next_batch(0); // the number of batches is known when the input ends
+    std::atomic<bool> failed(false);
+
+    // Waits until `stamp` becomes `value`: returns false if batch `n` turns out to be past the end of the input
+    auto wait = [&batches_count](const std::atomic<size_t> &stamp, size_t value, size_t n) {
+        for (unsigned spins = 0; stamp.load(std::memory_order_acquire) != value; spins++) {
+            if (batches_count.load(std::memory_order_acquire) <= n)
+                return false;
+            if (spins < 64)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+        return true;
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++)
+        pool.emplace_back([&] {
+            Converter converter(true);
+            converter.compact_ohd = compact_ohd;
+            Output html;
+            std::string text;
+            while (true) {
+                size_t n = next_batch++;
+                Batch &b = ring[n % ring_size];
+                if (!wait(b.stamp, 3 * n + 1, n))
+                    break;
+                b.output.clear();
+                std::string_view input = b.input;
+                for (size_t start = 0; start < input.length();) {
+                    size_t end = std::min(input.find('\n', start), input.length());
+                    std::string_view line = input.substr(start, end - start);
+                    if (!line.empty() && line.back() == '\r')
+                        line.remove_suffix(1);
+                    if (json_skip_spaces(line, 0) < line.length() && !jsonl_convert_line(line, converter, html, text, b.output))
+                        failed = true;
+                    start = end + 1;
+                }
+                b.stamp.store(3 * n + 2, std::memory_order_release);
+            }
+        });
+    std::thread writer([&] {
+        for (size_t n = 0; wait(ring[n % ring_size].stamp, 3 * n + 2, n); n++) {
+            Batch &b = ring[n % ring_size];
+            if (fwrite(b.output.data(), 1, b.output.length(), out) != b.output.length())
+                failed = true;
+            b.stamp.store(3 * (n + ring_size), std::memory_order_release);
+        }
+        fflush(out);
+    });
+
+    std::string rest; // an incomplete line at the end of the previous batch
+    size_t n = 0;
+    for (bool eof = false; !eof; n++) {
+        Batch &b = ring[n % ring_size];
+        wait(b.stamp, 3 * n, n);
+        b.input.swap(rest);
+        rest.clear();
+        while (!eof && (b.input.length() < batch_size || b.input.find('\n') == std::string::npos)) {
+            size_t len = b.input.length(), chunk = std::min(batch_size, (size_t)65536);
+            b.input.resize(len + chunk);
+            size_t read = fread(&b.input[len], 1, chunk, in);
+            b.input.resize(len + read);
+            eof = read == 0;
+        }
+        if (n == 0 && b.input.compare(0, 3, "\xEF\xBB\xBF") == 0)
+            b.input.erase(0, 3);
+        size_t last_line_end = b.input.rfind('\n');
+        if (!eof && last_line_end != std::string::npos) {
+            rest.assign(b.input, last_line_end + 1);
+            b.input.resize(last_line_end + 1);
+        }
+        if (eof && b.input.empty())
+            break;
+        b.stamp.store(3 * n + 1, std::memory_order_release);
+    }
+    batches_count.store(n, std::memory_order_release);
+    for (auto &&t : pool)
+        t.join();
+    writer.join();
+    return !failed;
+}
+
+// `pqmarkup_lite --jsonl [-j threads] [--compact]`: converts JSONL from standard input to standard output (see `jsonl_convert()`)
+int jsonl_main(int argc, char *argv[])
+{
+    BatchOptions options;
+    for (int a = 0; a < argc; a++)
+        if (!options.parse(argc, argv, a)) {
+            std::cerr << "Usage: pqmarkup_lite --jsonl [-j threads] [--compact]\n";
+            return -1;
+        }
+    return jsonl_convert(stdin, stdout, options.threads, options.compact_ohd) ? 0 : -1;
+}
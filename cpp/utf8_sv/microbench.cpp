@@ -0,0 +1,390 @@
+// Microbenchmarks of the primitives of the converter, measured one by one on generated inputs of several sizes and densities.
+// Build: g++ -std=c++17 -O2 -DNDEBUG -o microbench microbench.cpp
+// Usage: microbench [--sizes 4K,64K,1M] [--densities 0.01,0.1] [--samples 15] [--min-time ms] [--filter kernel] [--json file] [--baseline file]
+//        microbench --latency calls [--sizes 100,1K,10K] [--json file] [--baseline file]
+//
+// Each case is run in samples of a fixed number of iterations, which is chosen so that a sample takes at least `--min-time`
+// milliseconds. The median time per iteration and the median absolute deviation (MAD) of the samples are reported.
+// `--json` writes the results (one JSON object per line) and `--baseline` compares with results written before:
+// a change is marked as significant when the medians differ by more than three MADs of the noisier run (about two standard
+// deviations for normally distributed noise).
+//
+// Free functions (html_escape() etc.) are called directly. The kernels which live inside `Converter::to_html()` (such as
+// `find_ending_pair_quote`) are measured by converting documents in which the construct handled by the kernel takes the given
+// share of bytes, the rest being plain text; case `plain` is the cost of such plain text alone.
+//
+// `--latency` times single calls converting small documents with mixed markup instead: the given number of calls per document
+// size and way of calling (a reused Converter and Output, SharedConverter returning a string or writing into a buffer on the stack
+// and a new Converter for each call)
+// is made and the 50th, 99th and 99.9th percentiles of the times of the calls are reported.
+#define PQMARKUP_LITE_NO_MAIN
+#include "utf8_sv.cpp"
+
+#include <chrono>
+#include <random>
+#include <functional>
+#include <memory>
+#include <cmath>
+
+namespace microbench
+{
+struct Case
+{
+    std::string kernel;
+    size_t size;
+    double density;
+    std::function<size_t()> run; // returns something depending on the result, so that the work can not be optimized out
+};
+
+struct Result
+{
+    std::string name; // `kernel/size/density`
+    double median_ns, mad_ns, min_ns;
+    size_t bytes;
+};
+
+// Deterministic text without markup: Latin and Cyrillic words, lines of about 80 bytes and a paragraph break every 10 lines
+class TextGenerator
+{
+    std::mt19937 rng;
+    size_t line_length = 0, lines = 0;
+public:
+    TextGenerator(unsigned seed = 1) : rng(seed) {}
+
+    void append_word(std::string &s)
+    {
+        static const char *words[] = {"the", "text", "of", "a", "document", "converter", "line", u8"текст", u8"и", u8"строка", u8"документа", "markup"};
+        const char *w = words[rng() % (sizeof(words) / sizeof(*words))];
+        s += w;
+        line_length += strlen(w) + 1;
+        if (line_length < 80)
+            s += ' ';
+        else {
+            s += ++lines % 10 == 0 ? "\n\n" : "\n";
+            line_length = 0;
+        }
+    }
+
+    size_t random(size_t n) {return rng() % n;}
+
+    // Text of `size` bytes in which `construct()` (appending a construct to the string) makes up about `density` of the bytes
+    template <class Construct> std::string generate(size_t size, double density, Construct &&construct)
+    {
+        std::string s;
+        size_t construct_bytes = 0;
+        while (s.length() < size) {
+            if (density > 0 && construct_bytes < density * s.length()) {
+                size_t before = s.length();
+                construct(s);
+                construct_bytes += s.length() - before;
+                s += ' ';
+            }
+            else
+                append_word(s);
+        }
+        return s;
+    }
+};
+
+std::vector<Case> make_cases(const std::vector<size_t> &sizes, const std::vector<double> &densities)
+{
+    std::vector<Case> cases;
+    auto add_direct = [&](const std::string &kernel, auto &&construct, auto &&run) {
+        for (size_t size : sizes)
+            for (double density : densities) {
+                auto input = std::make_shared<std::string>(TextGenerator().generate(size, density, construct));
+                cases.push_back({kernel, size, density, [input, run]() {return run(*input);}});
+            }
+    };
+    auto add_document = [&](const std::string &kernel, auto &&construct, bool with_density = true) {
+        for (size_t size : sizes)
+            for (double density : with_density ? densities : std::vector<double>{0}) {
+                TextGenerator gen;
+                auto input = std::make_shared<std::string>(gen.generate(size, density, [&](std::string &s) {construct(s, gen);}));
+                auto converter = std::make_shared<Converter>(true);
+                auto out = std::make_shared<Output>();
+                try {
+                    converter->to_html(*input, *out);
+                }
+                catch (const Exception &e) {
+                    std::cerr << "Generated input of `" << kernel << "` is invalid: " << e.message << " at " << e.line << ":" << e.column << "\n";
+                    exit(-1);
+                }
+                cases.push_back({kernel, size, with_density ? density : 0, [input, converter, out]() {
+                    out->clear();
+                    converter->to_html(*input, *out);
+                    return out->size();
+                }});
+            }
+    };
+
+    // Free functions
+    add_direct("replace_all", [](std::string &s) {s += '&';},
+        [](const std::string &s) {return replace_all(std::string(s), "&", "&amp;").length();});
+    add_direct("html_escape", [](std::string &s) {s += "&<";},
+        [](const std::string &s) {return html_escape(std::string_view(s)).length();});
+    add_direct("html_escapeq", [](std::string &s) {s += "&<\"";},
+        [](const std::string &s) {return html_escapeq(std::string_view(s)).length();});
+    add_direct("rune_len_at", [](std::string &s) {s += u8"ё";}, // the density is that of 2-byte characters (the text has Cyrillic words too)
+        [](const std::string &s) {
+            size_t runes = 0;
+            for (int i = 0, n = (int)s.length(); i < n; i += rune_len_at(s, i))
+                runes++;
+            return runes;
+        });
+    add_direct("split", [](std::string &s) {s += '\n';},
+        [](const std::string &s) {return split(s, "\n").size();});
+
+    // Kernels of `Converter::to_html()`
+    add_document("plain", [](std::string &, TextGenerator &) {}, false);
+    add_document("find_ending_pair_quote", [](std::string &s, TextGenerator &gen) { // bold text with nested quotes
+        s += u8"*‘bold ‘nested’ text";
+        for (size_t i = gen.random(4); i > 0; i--)
+            s += u8" ‘more’";
+        s += u8"’";
+    });
+    add_document("find_ending_sq_bracket", [](std::string &s, TextGenerator &gen) { // comments
+        s += "[[[comment";
+        for (size_t i = gen.random(4); i > 0; i--)
+            s += " [with brackets]";
+        s += "]]]";
+    });
+    add_document("remove_comments", [](std::string &s, TextGenerator &) { // link titles with comments
+        s += u8"link[http://example.com/ ‘title [[[comment]]] and [[[another]]] comment’]";
+    });
+    add_document("backticks", [](std::string &s, TextGenerator &gen) {
+        if (gen.random(2) == 0)
+            s += "`code span`";
+        else
+            s += "``code with ` backtick``";
+    });
+    add_document("write_http_link", [](std::string &s, TextGenerator &gen) {
+        if (gen.random(2) == 0)
+            s += "link[http://example.com/path/page.html]";
+        else
+            s += "[https://example.com/a?b=c&d=e]";
+    });
+    return cases;
+}
+
+Result measure(const Case &c, int samples, double min_time_ms)
+{
+    using clock = std::chrono::steady_clock;
+    volatile size_t sink = 0;
+    auto time_ns = [&](size_t iterations) {
+        auto start = clock::now();
+        for (size_t i = 0; i < iterations; i++)
+            sink = sink + c.run();
+        return std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    };
+
+    // Warm up (caches, buffers of Output and Converter) and find the number of iterations per sample
+    size_t iterations = 1;
+    time_ns(1);
+    while (time_ns(iterations) < min_time_ms * 1e6)
+        iterations *= 2;
+
+    std::vector<double> times;
+    for (int s = 0; s < samples; s++)
+        times.push_back(time_ns(iterations) / iterations);
+    auto median = [](std::vector<double> v) {
+        std::sort(v.begin(), v.end());
+        return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2;
+    };
+    double med = median(times);
+    std::vector<double> deviations;
+    for (double t : times)
+        deviations.push_back(fabs(t - med));
+
+    char name[128];
+    snprintf(name, sizeof(name), "%s/%zu/%g", c.kernel.c_str(), c.size, c.density);
+    return {name, med, median(deviations), *std::min_element(times.begin(), times.end()), c.size};
+}
+
+struct LatencyResult
+{
+    std::string name; // `latency/way/size`
+    double p50_ns, p99_ns, p999_ns;
+};
+
+std::vector<LatencyResult> measure_latency(const std::vector<size_t> &sizes, size_t calls)
+{
+    using clock = std::chrono::steady_clock;
+    std::vector<LatencyResult> results;
+    for (size_t size : sizes) {
+        std::vector<std::string> docs;
+        for (unsigned seed = 1; seed <= 256; seed++) {
+            TextGenerator gen(seed);
+            docs.push_back(gen.generate(size, 0.2, [&gen](std::string &s) {
+                static const char *constructs[] = {u8"*‘bold’", "[[[comment]]]", "link[http://example.com/page]", "`code`", u8"link[http://example.com/ ‘title’]", u8"~‘italic ‘quote’ text’"};
+                s += constructs[gen.random(sizeof(constructs) / sizeof(*constructs))];
+            }));
+        }
+        Converter converter(true);
+        Output out;
+        const SharedConverter shared(true);
+        std::pair<const char*, std::function<size_t(const std::string&)>> ways[] = {
+            {"context", [&](const std::string &doc) {out.clear(); converter.to_html(doc, out); return out.size();}},
+            {"shared", [&](const std::string &doc) {return shared.to_html(doc).length();}},
+            {"buffer", [&](const std::string &doc) {
+                char buffer[64*1024];
+                return shared.to_html(doc, buffer, sizeof(buffer));
+            }},
+            {"fresh", [&](const std::string &doc) {return Converter(true).to_html(doc).length();}},
+        };
+        for (auto &&way : ways) {
+            volatile size_t sink = 0;
+            for (auto &&doc : docs) // warm up
+                sink = sink + way.second(doc);
+            std::vector<double> times(calls);
+            for (size_t c = 0; c < calls; c++) {
+                auto start = clock::now();
+                sink = sink + way.second(docs[c % docs.size()]);
+                times[c] = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+            }
+            std::sort(times.begin(), times.end());
+            auto percentile = [&times](double p) {return times[std::min(times.size() - 1, size_t(p * times.size()))];};
+            results.push_back({"latency/" + std::string(way.first) + "/" + std::to_string(size), percentile(0.5), percentile(0.99), percentile(0.999)});
+        }
+    }
+    return results;
+}
+
+std::unordered_map<std::string, Result> read_results(const std::string &path)
+{
+    std::unordered_map<std::string, Result> results;
+    FILE *f = NULL;
+    fopen_s(&f, path.c_str(), "rb");
+    if (f == NULL) {
+        std::cerr << "Can't open file '" << path << "'\n";
+        exit(-1);
+    }
+    char line[512], name[256];
+    Result r;
+    double p999;
+    while (fgets(line, sizeof(line), f) != NULL)
+        if (sscanf(line, "{\"case\": \"%255[^\"]\", \"median_ns\": %lf, \"mad_ns\": %lf, \"min_ns\": %lf, \"bytes\": %zu}", name, &r.median_ns, &r.mad_ns, &r.min_ns, &r.bytes) == 5
+                || sscanf(line, "{\"case\": \"%255[^\"]\", \"p50_ns\": %lf, \"p99_ns\": %lf, \"p999_ns\": %lf}", name, &r.median_ns, &r.mad_ns, &p999) == 4) { // percentiles are kept in `median_ns` and `mad_ns`
+            r.name = name;
+            results[name] = r;
+        }
+    fclose(f);
+    return results;
+}
+
+std::vector<std::string> split_list(const std::string &s)
+{
+    return split(s, ",");
+}
+
+size_t parse_size(const std::string &s)
+{
+    size_t n = std::stoull(s);
+    switch (s.back()) {
+    case 'K': case 'k': return n * 1024;
+    case 'M': case 'm': return n * 1024 * 1024;
+    }
+    return n;
+}
+}
+
+int main(int argc, char *argv[])
+{
+    using namespace microbench;
+    std::vector<size_t> sizes = {4*1024, 64*1024, 1024*1024};
+    std::vector<double> densities = {0.01, 0.1};
+    int samples = 15;
+    double min_time_ms = 10;
+    std::string filter, json_path, baseline_path;
+    size_t latency_calls = 0;
+    bool sizes_given = false;
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (a + 1 == argc) {
+            std::cerr << "Missing value of " << arg << "\n";
+            return -1;
+        }
+        std::string value = argv[++a];
+        if (arg == "--sizes") {
+            sizes_given = true;
+            sizes.clear();
+            for (auto &&s : split_list(value))
+                sizes.push_back(parse_size(s));
+        }
+        else if (arg == "--densities") {
+            densities.clear();
+            for (auto &&d : split_list(value))
+                densities.push_back(std::stod(d));
+        }
+        else if (arg == "--samples")
+            samples = std::max(1, std::stoi(value));
+        else if (arg == "--min-time")
+            min_time_ms = std::stod(value);
+        else if (arg == "--filter")
+            filter = value;
+        else if (arg == "--json")
+            json_path = value;
+        else if (arg == "--baseline")
+            baseline_path = value;
+        else if (arg == "--latency")
+            latency_calls = std::max(1, std::stoi(value));
+        else {
+            std::cerr << "Unknown option " << arg << "\n";
+            return -1;
+        }
+    }
+    std::unordered_map<std::string, Result> baseline;
+    if (!baseline_path.empty())
+        baseline = read_results(baseline_path);
+
+    std::string json;
+    if (latency_calls != 0) {
+        printf("%-40s %10s %10s %10s", "case (latency/way/bytes)", "p50 ns", "p99 ns", "p99.9 ns");
+        if (!baseline_path.empty())
+            printf(" %10s %10s", "p50 vs base", "p99 vs base");
+        printf("\n");
+        for (auto &&r : measure_latency(sizes_given ? sizes : std::vector<size_t>{100, 1024, 10*1024}, latency_calls)) {
+            printf("%-40s %10.0f %10.0f %10.0f", r.name.c_str(), r.p50_ns, r.p99_ns, r.p999_ns);
+            auto b = baseline.find(r.name);
+            if (b != baseline.end())
+                printf(" %+10.1f%% %+10.1f%%", 100 * (r.p50_ns / b->second.median_ns - 1), 100 * (r.p99_ns / b->second.mad_ns - 1));
+            printf("\n");
+            char line[512];
+            snprintf(line, sizeof(line), "{\"case\": \"%s\", \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f}\n", r.name.c_str(), r.p50_ns, r.p99_ns, r.p999_ns);
+            json += line;
+        }
+    }
+    else {
+        printf("%-40s %12s %9s %9s", "case (kernel/bytes/density)", "median ns", "MAD", "MB/s");
+        if (!baseline_path.empty())
+            printf(" %10s", "vs base");
+        printf("\n");
+        for (auto &&c : make_cases(sizes, densities)) {
+            if (!filter.empty() && c.kernel.find(filter) == std::string::npos)
+                continue;
+            Result r = measure(c, samples, min_time_ms);
+            printf("%-40s %12.0f %8.1f%% %9.1f", r.name.c_str(), r.median_ns, 100 * r.mad_ns / r.median_ns, r.bytes / r.median_ns * 1e3);
+            auto b = baseline.find(r.name);
+            if (b != baseline.end()) {
+                double change = (r.median_ns - b->second.median_ns) / b->second.median_ns;
+                bool significant = fabs(r.median_ns - b->second.median_ns) > 3 * std::max(r.mad_ns, b->second.mad_ns);
+                printf(" %+9.1f%%%s", 100 * change, significant ? " *" : "");
+            }
+            printf("\n");
+            fflush(stdout);
+            char line[512];
+            snprintf(line, sizeof(line), "{\"case\": \"%s\", \"median_ns\": %.1f, \"mad_ns\": %.1f, \"min_ns\": %.1f, \"bytes\": %zu}\n", r.name.c_str(), r.median_ns, r.mad_ns, r.min_ns, r.bytes);
+            json += line;
+        }
+        if (!baseline_path.empty())
+            printf("* significant change (medians differ by more than 3 MADs)\n");
+    }
+    if (!json_path.empty()) {
+        FILE *f = NULL;
+        fopen_s(&f, json_path.c_str(), "wb");
+        if (f == NULL || fwrite(json.data(), 1, json.length(), f) != json.length() || fclose(f) != 0) {
+            std::cerr << "Can't write file '" << json_path << "'\n";
+            return -1;
+        }
+    }
+}
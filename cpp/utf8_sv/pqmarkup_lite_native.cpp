@@ -0,0 +1,142 @@
+// CPython extension module `pqmarkup_lite_native`: the C++ engine behind the interface of pqmarkup_lite.py.
+// Build with `python setup.py build_ext --inplace` (see setup.py in the repository root).
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define PQMARKUP_LITE_NO_MAIN
+#include "utf8_sv.cpp"
+
+// `pqmarkup_lite_native.Exception`, defined in Python so that it is the same as `pqmarkup_lite.Exception`
+static PyObject *exception_type = NULL;
+
+static const char exception_source[] =
+    "class Exception(Exception):\n"
+    "    message : str\n"
+    "    line : int\n"
+    "    column : int\n"
+    "    pos : int\n"
+    "    def __init__(self, message, line, column, pos):\n"
+    "        self.message = message\n"
+    "        self.line = line\n"
+    "        self.column = column\n"
+    "        self.pos = pos\n";
+
+// `to_html(instr, outfilef = None, ohd = False)`
+static PyObject *native_to_html(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"instr", "outfilef", "ohd", NULL};
+    PyObject *instr_obj, *outfilef = Py_None;
+    int ohd = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U|Op:to_html", const_cast<char**>(keywords), &instr_obj, &outfilef, &ohd))
+        return NULL;
+
+    // The UTF-8 representation is cached in the str object (and is the object's own buffer for ASCII strings), so it is not copied.
+    // `instr_obj` is kept alive by the caller while the GIL is released.
+    Py_ssize_t instr_len;
+    const char *instr_data = PyUnicode_AsUTF8AndSize(instr_obj, &instr_len);
+    if (instr_data == NULL)
+        return NULL;
+
+    // Conversion contexts (see SharedConverter) and output buffers are reused between calls made by the same thread
+    const SharedConverter converter(ohd != 0);
+    thread_local Output out;
+    thread_local std::string result;
+    bool failed = false, out_of_memory = false;
+    Exception error("", 0, 0, 0);
+    Py_BEGIN_ALLOW_THREADS
+    try {
+        out.clear();
+        result.clear();
+        converter.to_html(std::string_view(instr_data, instr_len), out);
+        out.append_to(result);
+    }
+    catch (const Exception &e) {
+        failed = true;
+        error = e;
+    }
+    catch (const std::bad_alloc &) {
+        out_of_memory = true;
+    }
+    Py_END_ALLOW_THREADS
+
+    if (out_of_memory)
+        return PyErr_NoMemory();
+    if (failed) {
+        PyObject *e = PyObject_CallFunction(exception_type, "s#nnn", error.message.data(), (Py_ssize_t)error.message.length(), (Py_ssize_t)error.line, (Py_ssize_t)error.column, (Py_ssize_t)error.pos);
+        if (e != NULL) {
+            PyErr_SetObject(exception_type, e);
+            Py_DECREF(e);
+        }
+        return NULL;
+    }
+
+    PyObject *html = PyUnicode_DecodeUTF8(result.data(), result.length(), NULL);
+    if (result.capacity() > 16*1024*1024) // do not keep the buffer of a huge document
+        std::string().swap(result);
+    if (html == NULL || outfilef == Py_None)
+        return html;
+    PyObject *r = PyObject_CallMethod(outfilef, "write", "O", html);
+    Py_DECREF(html);
+    if (r == NULL)
+        return NULL;
+    Py_DECREF(r);
+    return PyUnicode_FromString("");
+}
+
+// `gzip_compress(data, level = 6, piece_size = 0)`: `data` compressed by GzipEncoder, written in pieces of `piece_size` bytes
+// (all at once if 0). Used by the tests of the encoder, which decompress the result with Python's gzip module.
+static PyObject *native_gzip_compress(PyObject *, PyObject *args, PyObject *kwargs)
+{
+    static const char *keywords[] = {"data", "level", "piece_size", NULL};
+    Py_buffer data;
+    int level = 6;
+    Py_ssize_t piece_size = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|in:gzip_compress", const_cast<char**>(keywords), &data, &level, &piece_size))
+        return NULL;
+
+    std::string_view d((const char*)data.buf, data.len);
+    GzipEncoder gzip(level);
+    Py_BEGIN_ALLOW_THREADS
+    if (piece_size <= 0)
+        gzip.write(d);
+    else
+        for (size_t p = 0; p < d.length(); p += piece_size)
+            gzip.write(d.substr(p, piece_size));
+    gzip.finish();
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&data);
+    return PyBytes_FromStringAndSize(gzip.out.data(), gzip.out.length());
+}
+
+static PyMethodDef native_methods[] = {
+    {"to_html", (PyCFunction)(void(*)(void))native_to_html, METH_VARARGS | METH_KEYWORDS,
+     "to_html(instr, outfilef=None, ohd=False)\n--\n\nConverts pqmarkup-lite text to HTML (raises Exception on syntax errors)."},
+    {"gzip_compress", (PyCFunction)(void(*)(void))native_gzip_compress, METH_VARARGS | METH_KEYWORDS,
+     "gzip_compress(data, level=6, piece_size=0)\n--\n\nCompresses bytes into the gzip format with the encoder of the command line interface."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef native_module = {
+    PyModuleDef_HEAD_INIT, "pqmarkup_lite_native", "pqmarkup-lite to HTML converter (C++ engine)", -1, native_methods
+};
+
+PyMODINIT_FUNC PyInit_pqmarkup_lite_native()
+{
+    PyObject *m = PyModule_Create(&native_module);
+    if (m == NULL)
+        return NULL;
+    PyObject *dict = PyModule_GetDict(m);
+    if (PyDict_GetItemString(dict, "__builtins__") == NULL && PyDict_SetItemString(dict, "__builtins__", PyEval_GetBuiltins()) != 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    PyObject *r = PyRun_String(exception_source, Py_file_input, dict, dict);
+    if (r == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_DECREF(r);
+    exception_type = PyDict_GetItemString(dict, "Exception"); // owned by the module dict
+    Py_INCREF(exception_type);
+    return m;
+}
@@ -0,0 +1,311 @@
+#pragma once
+// This is a part of utf8_sv.cpp, which includes it after batch.h (pages of a site are converted by `run_batch()`).
+
+// Site build (`--site source-dir output-dir`): converts every .pq file of the source tree into a .html file at the same place
+// of the output tree. The manifest `output-dir/.pqmarkup-site` records size, modification time and hash of every source,
+// its output path and its dependencies: the page template and the files which the page declares in `[[[depends: path ...]]]`
+// comments (paths are relative to the page). On later runs only new pages, pages whose source or dependencies have changed and
+// pages whose output is missing are converted, and outputs of deleted pages are removed. Up-to-date checks run in parallel.
+struct SiteFileState
+{
+    uint64_t size = 0, hash = 0;
+    int64_t mtime = 0;
+};
+
+struct SitePage
+{
+    std::string source, output; // relative to the source and the output directory
+    SiteFileState state;
+    std::vector<std::string> depends; // relative to the source directory
+    bool rebuild = false;
+};
+
+bool stat_file(const std::string &path, SiteFileState &state)
+{
+#ifndef _WIN32
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    state.size = st.st_size;
+#ifdef __APPLE__
+    state.mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    state.mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#else
+    std::error_code ec;
+    state.size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return false;
+    state.mtime = std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+#endif
+    return true;
+}
+
+bool read_file(const std::string &path, std::string &contents)
+{
+    FILE *f = NULL;
+    fopen_s(&f, path.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    contents.clear();
+    char chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        contents.append(chunk, n);
+    fclose(f);
+    return true;
+}
+
+// Collects paths from `[[[depends: path ...]]]` comments of a page
+std::vector<std::string> site_page_depends(const std::string &page, std::string_view contents)
+{
+    std::vector<std::string> depends;
+    const std::string_view marker = "[[[depends:"; // ]]]
+    for (size_t pos = contents.find(marker); pos != std::string_view::npos; pos = contents.find(marker, pos)) {
+        pos += marker.length();
+        size_t end = contents.find("]]]", pos);
+        if (end == std::string_view::npos)
+            break;
+        std::string_view list = contents.substr(pos, end - pos);
+        for (size_t start = 0; start < list.length();) {
+            size_t stop = list.find_first_of(" \n", start);
+            if (stop == std::string_view::npos)
+                stop = list.length();
+            if (stop > start)
+                depends.push_back((std::filesystem::path(page).parent_path() / std::string(list.substr(start, stop - start))).lexically_normal().generic_string());
+            start = stop + 1;
+        }
+        pos = end;
+    }
+    return depends;
+}
+
+template <class Func> void parallel_for(size_t n, unsigned threads, Func &&f)
+{
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < threads; t++)
+        pool.emplace_back([&] {
+            for (size_t i; (i = next++) < n;)
+                f(i);
+        });
+    for (auto &&t : pool)
+        t.join();
+}
+
+// `pqmarkup_lite --site source-dir output-dir [--force] [--io=uring|threads|sync] [-j threads] [--depth files-in-flight] [--template file]`
+int site_main(int argc, char *argv[])
+{
+    namespace fs = std::filesystem;
+    BatchOptions options;
+    std::vector<std::string> dirs;
+    bool force = false;
+    for (int a = 0; a < argc; a++)
+        if (strcmp(argv[a], "--force") == 0)
+            force = true;
+        else if (!options.parse(argc, argv, a))
+            dirs.push_back(argv[a]);
+    if (dirs.size() != 2) {
+        std::cerr << "Usage: pqmarkup_lite --site source-dir output-dir [options]\n";
+        return -1;
+    }
+    const fs::path source_dir = dirs[0], output_dir = dirs[1], manifest_path = output_dir / ".pqmarkup-site";
+    const unsigned io_threads = std::max(options.threads, options.depth / 4);
+
+    PageTemplate page_template;
+    std::string error;
+    if (!options.template_file.empty() && !page_template.load(options.template_file, error)) {
+        std::cerr << error << "\n";
+        return -1;
+    }
+    if (options.compact_ohd)
+        page_template.set_compact_ohd();
+    char fingerprint[32];
+    snprintf(fingerprint, sizeof(fingerprint), "%016llx", (unsigned long long)fnv1a(std::to_string(options.gzip_level), page_template.fingerprint())); // the template and the options affecting the output
+
+    // Read the manifest of the previous build
+    std::unordered_map<std::string, SitePage> old_pages;
+    std::unordered_map<std::string, SiteFileState> old_depends;
+    std::string manifest;
+    if (!force && read_file(manifest_path.string(), manifest)
+            && manifest.compare(0, manifest.find('\n'), "pqmarkup-site 1 " + std::string(fingerprint)) == 0) // a changed template or gzip level invalidates all pages
+        for (auto &&line : split(manifest.substr(manifest.find('\n') + 1), "\n")) {
+            std::vector<std::string> fields = split(line, "\t");
+            if (fields[0] == "P" && fields.size() >= 6) {
+                SitePage &p = old_pages[fields[1]];
+                p.source = fields[1];
+                p.output = fields[2];
+                p.state = {std::stoull(fields[3]), std::stoull(fields[4], NULL, 16), std::stoll(fields[5])};
+                p.depends.assign(fields.begin() + 6, fields.end());
+            }
+            else if (fields[0] == "D" && fields.size() == 5)
+                old_depends[fields[1]] = {std::stoull(fields[2]), std::stoull(fields[3], NULL, 16), std::stoll(fields[4])};
+        }
+
+    // Find all pages
+    std::vector<SitePage> pages;
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(source_dir, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+        if (it->path().extension() == ".pq" && it->is_regular_file(ec)) {
+            SitePage p;
+            p.source = it->path().lexically_relative(source_dir).generic_string();
+            p.output = batch_output_path(p.source);
+            pages.push_back(std::move(p));
+        }
+    if (ec) {
+        std::cerr << "Can't read directory '" << source_dir.string() << "': " << ec.message() << "\n";
+        return -1;
+    }
+    std::sort(pages.begin(), pages.end(), [](const SitePage &a, const SitePage &b) {return a.source < b.source;});
+
+    // Check which pages are up to date: unchanged size and modification time (or unchanged hash) and an existing output.
+    // `check_file()` returns false if the file can not be read, `contents` is read only if the file has changed or `old` is NULL.
+    auto check_file = [](const std::string &path, const SiteFileState *old, SiteFileState &state, bool &unchanged, std::string *contents = NULL) {
+        unchanged = false;
+        if (!stat_file(path, state))
+            return false;
+        if (old != NULL && old->size == state.size && old->mtime == state.mtime) {
+            state.hash = old->hash;
+            unchanged = true;
+            return true;
+        }
+        std::string buf;
+        if (contents == NULL)
+            contents = &buf;
+        if (!read_file(path, *contents))
+            return false;
+        state.hash = fnv1a(*contents);
+        unchanged = old != NULL && old->size == state.size && old->hash == state.hash;
+        return true;
+    };
+    parallel_for(pages.size(), io_threads, [&](size_t i) {
+        SitePage &p = pages[i];
+        auto old = old_pages.find(p.source);
+        SiteFileState output_state;
+        bool unchanged;
+        bool up_to_date = old != old_pages.end() && check_file((source_dir / p.source).string(), &old->second.state, p.state, unchanged) && unchanged
+                          && old->second.output == p.output && stat_file((output_dir / p.output).string(), output_state)
+                          && (options.gzip_level < 0 || stat_file((output_dir / (p.output + ".gz")).string(), output_state));
+        if (up_to_date)
+            p.depends = old->second.depends;
+        else
+            p.rebuild = true;
+    });
+
+    // Pages depending on changed files are rebuilt too
+    std::unordered_map<std::string, SiteFileState> depends;
+    for (auto &&p : pages)
+        for (auto &&d : p.depends)
+            depends[d];
+    std::vector<std::pair<const std::string, SiteFileState>*> depends_list;
+    for (auto &&d : depends)
+        depends_list.push_back(&d);
+    std::vector<char> depend_changed(depends_list.size());
+    parallel_for(depends_list.size(), io_threads, [&](size_t i) {
+        auto old = old_depends.find(depends_list[i]->first);
+        bool unchanged;
+        check_file((source_dir / depends_list[i]->first).string(), old != old_depends.end() ? &old->second : NULL, depends_list[i]->second, unchanged);
+        depend_changed[i] = !unchanged;
+    });
+    std::unordered_map<std::string, bool> changed;
+    for (size_t i = 0; i < depends_list.size(); i++)
+        changed[depends_list[i]->first] = depend_changed[i];
+    for (auto &&p : pages)
+        if (!p.rebuild)
+            for (auto &&d : p.depends)
+                if (changed[d]) {
+                    p.rebuild = true;
+                    break;
+                }
+
+    // Convert changed pages
+    int result = 0;
+    std::vector<BatchJob> jobs;
+    std::vector<size_t> job_pages;
+    std::unordered_map<std::string, bool> created_dirs;
+    for (size_t i = 0; i < pages.size(); i++) {
+        SitePage &p = pages[i];
+        if (!p.rebuild)
+            continue;
+        std::string contents;
+        bool unchanged;
+        if (!check_file((source_dir / p.source).string(), NULL, p.state, unchanged, &contents)) {
+            std::cerr << p.source << ": Can't read file\n";
+            p.source.clear();
+            result = -1;
+            continue;
+        }
+        p.depends = site_page_depends(p.source, contents);
+        for (auto &&d : p.depends)
+            if (depends.find(d) == depends.end())
+                check_file((source_dir / d).string(), NULL, depends[d], unchanged);
+        fs::path output = output_dir / p.output;
+        if (!created_dirs[output.parent_path().string()]) {
+            fs::create_directories(output.parent_path(), ec);
+            created_dirs[output.parent_path().string()] = true;
+        }
+        jobs.push_back({(source_dir / p.source).string(), output.string(), std::string()});
+        job_pages.push_back(i);
+    }
+    if (!run_batch(jobs, page_template, options))
+        return -1;
+    size_t failed = 0;
+    for (size_t j = 0; j < jobs.size(); j++)
+        if (!jobs[j].error.empty()) {
+            failed++;
+            std::cerr << pages[job_pages[j]].source << ": " << jobs[j].error << "\n";
+            pages[job_pages[j]].source.clear(); // not recorded in the manifest, so it is converted again on the next run
+            result = -1;
+        }
+
+    // Remove outputs of deleted pages
+    size_t removed = 0;
+    std::unordered_map<std::string, bool> outputs;
+    for (auto &&p : pages)
+        outputs[p.output] = true;
+    for (auto &&old : old_pages)
+        if (!outputs[old.second.output] && fs::remove(output_dir / old.second.output, ec)) {
+            fs::remove(output_dir / (old.second.output + ".gz"), ec);
+            removed++;
+        }
+
+    // Write the new manifest
+    manifest = "pqmarkup-site 1 " + std::string(fingerprint) + "\n";
+    char numbers[64];
+    auto append_state = [&manifest, &numbers](const SiteFileState &state) {
+        snprintf(numbers, sizeof(numbers), "\t%llu\t%016llx\t%lld", (unsigned long long)state.size, (unsigned long long)state.hash, (long long)state.mtime);
+        manifest += numbers;
+    };
+    for (auto &&p : pages) {
+        if (p.source.empty())
+            continue;
+        manifest += "P\t" + p.source + "\t" + p.output;
+        append_state(p.state);
+        for (auto &&d : p.depends)
+            manifest += "\t" + d;
+        manifest += "\n";
+    }
+    for (auto &&d : depends) {
+        manifest += "D\t" + d.first;
+        append_state(d.second);
+        manifest += "\n";
+    }
+    fs::create_directories(output_dir, ec);
+    std::string tmp_path = manifest_path.string() + ".tmp";
+    FILE *f = NULL;
+    fopen_s(&f, tmp_path.c_str(), "wb");
+    if (f == NULL || fwrite(manifest.data(), 1, manifest.length(), f) != manifest.length() || fclose(f) != 0) {
+        std::cerr << "Can't write file '" << tmp_path << "'\n";
+        return -1;
+    }
+    fs::rename(tmp_path, manifest_path, ec);
+
+    std::cout << "Converted " << jobs.size() - failed << " of " << pages.size() << " pages";
+    if (failed != 0)
+        std::cout << ", failed " << failed;
+    if (removed != 0)
+        std::cout << ", removed " << removed;
+    std::cout << "\n";
+    return result;
+}
@@ -0,0 +1,351 @@
+﻿// Tests of the C++ engine beyond the conversion of tests.txt, which `utf8_sv -t` checks: memory allocations, threads,
+// streaming, validation and diagnostics, JSONL, outline, plain text and source maps. Build and run in this directory:
+//   g++ -std=c++17 -O2 -pthread -o tests tests.cpp && ./tests
+#define PQMARKUP_LITE_NO_MAIN
+#include "utf8_sv.cpp"
+
+// Number of memory allocations made by the current thread, counted by the replaced global operator new
+thread_local size_t allocations_count = 0;
+
+void *operator new(size_t size)
+{
+    allocations_count++;
+    if (void *p = malloc(size != 0 ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+#if defined(__GNUC__) && __GNUC__ >= 11 && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete" // false positive when these operators are inlined into callers
+#endif
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+#if defined(__GNUC__) && __GNUC__ >= 11 && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+int main()
+{
+    FILE *tests_file = NULL;
+    fopen_s(&tests_file, "../../tests.txt", "rb");
+    if (tests_file == NULL) {
+        std::cerr << "Can't open file '../../tests.txt'\n";
+        return -1;
+    }
+    fseek(tests_file, 0, SEEK_END);
+    size_t tests_file_size = ftell(tests_file);
+    fseek(tests_file, 0, SEEK_SET);
+    std::string tests_file_str;
+    tests_file_str.resize(tests_file_size);
+    fread(const_cast<char*>(tests_file_str.data()), tests_file_size, 1, tests_file);
+    fclose(tests_file);
+
+    // Inputs of tests.txt (their conversion is checked by `utf8_sv -t`)
+    std::vector<std::string> inputs;
+    for (auto &&test : split(tests_file_str, "|\n\n|"))
+        inputs.push_back(test.substr(0, test.find(" (()) ")));
+
+    // Positions of nested calls of `to_html()` (e.g. for link text) must not be truncated in documents over 2 GB
+    if (nested_call_offset({0, ptrdiff_t(1) << 31, 2200000001 - (ptrdiff_t(1) << 31) - 1}) != 2200000000) {
+        std::cerr << "Position of a nested call of to_html() is truncated\n";
+        return -1;
+    }
+
+    // Conversion must not allocate memory once the buffers of Converter and Output have warmed up
+    Converter converter(true);
+    Output out;
+    for (int pass = 0; pass < 2; pass++)
+        for (size_t t = 0; t < inputs.size(); t++) {
+            size_t allocations_before = allocations_count;
+            out.clear();
+            converter.to_html(inputs[t], out);
+            if (pass == 1 && allocations_count != allocations_before) {
+                std::cerr << "Memory allocation during conversion in test #" << t + 1 << "\n";
+                return -1;
+            }
+        }
+
+    // The same for SharedConverter writing into a buffer on the stack
+    {
+        const SharedConverter shared(true);
+        char buffer[16*1024];
+        for (int pass = 0; pass < 2; pass++)
+            for (size_t t = 0; t < inputs.size(); t++) {
+                size_t allocations_before = allocations_count;
+                size_t size = shared.to_html(inputs[t], buffer, sizeof(buffer));
+                if (pass == 1 && allocations_count != allocations_before) {
+                    std::cerr << "Memory allocation during conversion into a buffer in test #" << t + 1 << "\n";
+                    return -1;
+                }
+                if (std::string_view(buffer, size) != to_html(inputs[t], NULL, true)) {
+                    std::cerr << "Conversion into a buffer differs in test #" << t + 1 << "\n";
+                    return -1;
+                }
+            }
+    }
+
+    // One SharedConverter used by several threads at once must give the same results as separate converters
+    {
+        std::vector<std::string> expected;
+        for (auto &&input : inputs)
+            expected.push_back(Converter(true).to_html(input));
+        const SharedConverter shared(true);
+        std::atomic<int> mismatches(0);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; t++)
+            threads.emplace_back([&] {
+                Output out;
+                for (int pass = 0; pass < 20; pass++)
+                    for (size_t i = 0; i < inputs.size(); i++) {
+                        out.clear();
+                        shared.to_html(inputs[i], out);
+                        if (out.str() != expected[i] || shared.to_html(inputs[i]) != expected[i])
+                            mismatches++;
+                    }
+            });
+        for (auto &&t : threads)
+            t.join();
+        if (mismatches != 0) {
+            std::cerr << "SharedConverter results differ in " << mismatches << " conversions\n";
+            return -1;
+        }
+    }
+
+    // Streaming conversion split at every safe point must give the same result as conversion of the whole document
+    for (size_t t = 0; t < inputs.size(); t++) {
+        std::string streamed;
+        out.clear();
+        converter.to_html_streaming(inputs[t], out, [&streamed](const Output &out, size_t) {out.append_to(streamed);}, 1);
+        if (streamed != to_html(inputs[t], NULL, true)) {
+            std::cerr << "Streaming conversion differs in test #" << t + 1 << "\n";
+            return -1;
+        }
+    }
+
+    // The same for input fed byte by byte
+    std::string streamed;
+    StreamConverter stream_converter(true, [&streamed](const Output &out) {out.append_to(streamed);});
+    for (size_t t = 0; t < inputs.size(); t++) {
+        streamed.clear();
+        for (char c : inputs[t])
+            stream_converter.feed(std::string_view(&c, 1));
+        stream_converter.finish();
+        if (streamed != to_html(inputs[t], NULL, true)) {
+            std::cerr << "Chunked conversion differs in test #" << t + 1 << "\n";
+            return -1;
+        }
+    }
+
+    // Validation must report the same error as conversion (checked on all prefixes of the tests, most of which are invalid)
+    for (size_t t = 0; t < inputs.size(); t++)
+        for (size_t len = 0; len <= inputs[t].length(); len++) {
+            if (len < inputs[t].length() && (inputs[t][len] & 0b1100'0000) == 0b1000'0000)
+                continue;
+            std::string_view prefix = std::string_view(inputs[t]).substr(0, len);
+            std::string converted = "OK", validated = "OK";
+            try {
+                out.clear();
+                converter.to_html(prefix, out);
+            }
+            catch (const Exception &e) {
+                converted = e.message + " at " + std::to_string(e.pos);
+            }
+            try {
+                converter.validate(prefix);
+            }
+            catch (const Exception &e) {
+                validated = e.message + " at " + std::to_string(e.pos);
+            }
+            if (validated != converted) {
+                std::cerr << "Validation differs in test #" << t + 1 << " cut at " << len << ": " << validated << " instead of " << converted << "\n";
+                return -1;
+            }
+            // and diagnostics must start with that error (small parts check recovery from errors caused by splitting)
+            std::vector<Exception> errors = converter.diagnose(prefix, 100, 16);
+            std::string diagnosed = errors.empty() ? "OK" : errors[0].message + " at " + std::to_string(errors[0].pos);
+            if (diagnosed != converted) {
+                std::cerr << "Diagnostics differ in test #" << t + 1 << " cut at " << len << ": " << diagnosed << " instead of " << converted << "\n";
+                return -1;
+            }
+        }
+
+    // Diagnostics must find all errors of a document in one pass
+    std::vector<Exception> errors = converter.diagnose(u8"x’ y\n\n`c\n\n[[[d\n\nok ‘‘a’\n", 100, 1);
+    std::string diagnosed;
+    for (auto &&e : errors)
+        diagnosed += e.message + " at " + std::to_string(e.line) + ":" + std::to_string(e.column) + "\n";
+    if (diagnosed != "Unpaired right single quotation mark at 1:2\n"
+                     "Unended ` started at 3:1\n"
+                     "Unended comment started at 5:1\n"
+                     "Unpaired left single quotation mark at 7:4\n"
+            || converter.diagnose(u8"’\n’\n’\n", 2).size() != 2
+            || converter.diagnose(u8"> /\\‘aH‘[H‘):‘b cН‘[[[’ ", 10).size() != 7) { // recovery may leave a comment quote unpaired
+        std::cerr << "Diagnostics failed:\n" << diagnosed;
+        return -1;
+    }
+
+    // Compact brackets must be the only difference from the full ohd markup
+    for (size_t t = 0; t < inputs.size(); t++) {
+        Converter compact(true);
+        compact.compact_ohd = true;
+        std::string html = compact.to_html(inputs[t]);
+        for (auto &&r : {std::make_pair("<span class=\"s\"><span class=\"b\">[</span>", "<span class=\"sq\"><span class=\"sq_brackets\">[</span>"),
+                         std::make_pair("<span class=\"b\">]</span></span>", "<span class=\"sq_brackets\">]</span></span>"),
+                         std::make_pair("<span class=\"c\"><span class=\"cb\">{</span><span class=\"h\">", u8"<span class=\"cu_brackets\" onclick=\"return spoiler(this, event)\"><span class=\"cu_brackets_b\">{</span><span>…</span><span class=\"cu\" style=\"display: none\">"),
+                         std::make_pair("</span><span class=\"cb\">}</span></span>", "</span><span class=\"cu_brackets_b\">}</span></span>")})
+            for (size_t p = 0; (p = html.find(r.first, p)) != html.npos; p += strlen(r.second))
+                html.replace(p, strlen(r.first), r.second);
+        if (html != to_html(inputs[t], NULL, true)) {
+            std::cerr << "Compact ohd markup differs in test #" << t + 1 << "\n";
+            return -1;
+        }
+    }
+
+    // JSONL conversion in many small batches by several threads must keep the order of the input
+    {
+        std::string jsonl, expected;
+        for (int pass = 0; pass < 20; pass++)
+            for (size_t t = 0; t < inputs.size(); t++) {
+                jsonl += "{\"id\": " + std::to_string(t) + ", \"text\": ";
+                append_json_string(jsonl, inputs[t]);
+                jsonl += pass % 2 ? "}\r\n" : "}\n";
+                expected += "{\"id\": " + std::to_string(t) + ", \"html\": ";
+                append_json_string(expected, to_html(inputs[t], NULL, true));
+                expected += "}\n";
+            }
+        jsonl += u8"{\"text\": \"\\u2018\\ud83d\\ude00\\/\\u2019\", \"id\": {\"a\": [\"}\"]}}\n{\"id\": 1, \"text\": \"\\u2019\"}\n{\"id\": 2}\n{\"id\": 3, \"text\": \"\\x\"}";
+        expected += u8"{\"id\": {\"a\": [\"}\"]}, \"html\": \"‘😀/’\"}\n"
+                    u8"{\"id\": 1, \"error\": \"Unpaired right single quotation mark\", \"line\": 1, \"column\": 1}\n"
+                    u8"{\"id\": 2, \"error\": \"No \\\"text\\\" string\"}\n{\"id\": 3, \"error\": \"Invalid JSON\"}\n";
+        FILE *in = tmpfile(), *out = tmpfile();
+        fwrite(jsonl.data(), 1, jsonl.length(), in);
+        rewind(in);
+        bool ok = jsonl_convert(in, out, 3, false, 16);
+        std::string result(ftell(out), '\0');
+        rewind(out);
+        if (!result.empty() && fread(&result[0], 1, result.length(), out) != result.length())
+            result.clear();
+        fclose(in);
+        fclose(out);
+        if (ok || result != expected) {
+            std::cerr << "JSONL conversion differs\n";
+            return -1;
+        }
+    }
+
+    // Outline extraction must find every header and link of the HTML
+    for (size_t t = 0; t < inputs.size(); t++) {
+        Converter::Outline outline = converter.extract_outline(inputs[t]);
+        std::string html = to_html(inputs[t], NULL, true);
+        size_t headers = 0, links = 0;
+        for (size_t p = html.find('<'); p != html.npos; p = html.find('<', p + 1))
+            if (html.compare(p, 2, "<h") == 0 && p + 2 < html.length() && html[p + 2] >= '1' && html[p + 2] <= '6')
+                headers++;
+            else if (html.compare(p, 9, "<a href=\"") == 0)
+                links++;
+        if (outline.headers.size() != headers || outline.links.size() != links) {
+            std::cerr << "Outline differs in test #" << t + 1 << "\n";
+            return -1;
+        }
+    }
+
+    // Plain text must be the text content of the HTML
+    for (size_t t = 0; t < inputs.size(); t++) {
+        TextOutput text, html_text;
+        converter.to_text(inputs[t], text);
+        html_text.write(to_html(inputs[t]));
+        if (text.str() != html_text.str()) {
+            std::cerr << "Plain text differs in test #" << t + 1 << ":\n" << text.str() << "\ninstead of:\n" << html_text.str() << "\n";
+            return -1;
+        }
+    }
+    // Each run of the source map must be a copy of the input
+    for (size_t t = 0; t < inputs.size(); t++) {
+        out.clear();
+        converter.to_html(inputs[t], out);
+        SourceMap map;
+        out.add_to_source_map(map, inputs[t]);
+        std::string html = out.str();
+        size_t out_end = 0;
+        bool ok = true;
+        map.for_each([&](const SourceMap::Run &r) {
+            ok = ok && r.out >= out_end && html.compare(r.out, r.length, inputs[t], r.in, r.length) == 0;
+            out_end = r.out + r.length;
+        });
+        if (!ok) {
+            std::cerr << "Source map is wrong in test #" << t + 1 << "\n";
+            return -1;
+        }
+    }
+    {
+        // Lookups starting at checkpoints must give the same results as decoding the whole map (of all tests, one after another)
+        SourceMap map;
+        size_t out_size = 0, in_size = 0;
+        for (size_t t = 0; t < inputs.size(); t++) {
+            out.clear();
+            converter.to_html(inputs[t], out);
+            out.add_to_source_map(map, inputs[t], out_size);
+            out_size += out.size();
+            in_size = std::max(in_size, inputs[t].length());
+        }
+        for (size_t o = 0; o <= out_size; o += 7) {
+            size_t in = 0;
+            map.for_each([&](const SourceMap::Run &r) {
+                if (r.out <= o)
+                    in = o < r.out + r.length ? r.in + (o - r.out) : r.in + r.length;
+            });
+            if (map.to_input(o) != in) {
+                std::cerr << "Source map lookup of output offset " << o << " failed\n";
+                return -1;
+            }
+        }
+        size_t map_end = 0; // of the last run
+        map.for_each([&](const SourceMap::Run &r) {map_end = r.out + r.length;});
+        for (size_t i = 0; i <= in_size; i++) {
+            size_t o = map_end;
+            map.for_each([&](const SourceMap::Run &r) {
+                if (r.in + r.length > i)
+                    o = std::min(o, r.out + (r.in > i ? 0 : i - r.in));
+            });
+            if (map.to_output(i) != o) {
+                std::cerr << "Source map lookup of input offset " << i << " failed\n";
+                return -1;
+            }
+        }
+    }
+    {
+        std::string_view doc = u8"*‘a&b’ c\n";
+        out.clear();
+        converter.to_html(doc, out);
+        SourceMap map;
+        out.add_to_source_map(map, doc);
+        if (out.str() != "<b>a&amp;b</b> c<br />\n" || map.to_input(3) != 4 || map.to_input(4) != 5 || map.to_input(9) != 6 || map.to_output(5) != 9 || map.to_output(10) != 14) {
+            std::cerr << "Source map lookup failed\n";
+            return -1;
+        }
+    }
+
+    TextOutput text;
+    text.write_hrefs = true;
+    text.block_separator = "|";
+    converter.to_text(u8"H‘A & B’\n*‘b’ <[http://x/?a&b title] [[[x]]]‘q’[./p]\n> r", text);
+    if (text.str() != u8"|A & B|\nb < (http://x/?a&b) q (./p)|\n|r") {
+        std::cerr << "Plain text failed: " << text.str() << "\n";
+        return -1;
+    }
+    text.clear();
+    converter.to_text("a {hidden} [b]", text); // `converter` is in `ohd` mode, which shows `{...}` as a spoiler with a placeholder
+    if (text.str() != "a {hidden} [b]") {
+        std::cerr << "Plain text of a spoiler failed: " << text.str() << "\n";
+        return -1;
+    }
+
+    std::cout << "All tests are passed!\n";
+    return 0;
+}
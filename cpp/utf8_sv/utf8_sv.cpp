@@ -5,29 +5,52 @@ using namespace std::string_literals;
 //#define NOMINMAX
 //#include <windows.h>
 #include <vector>
-#include <list>
 #include <numeric>
 #include <algorithm>
 #include <iostream>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <filesystem>
+#include <type_traits>
 //#define assert(...) do {} while(false)
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 
 #ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 void fopen_s(FILE **f, char const* fname, char const* mode)
 {
     *f = fopen(fname, mode);
 }
 #endif
 
+#include "gzip_encoder.h"
+
 class Exception
 {
 public:
     std::string message;
-    int line, column, pos;
+    size_t line, column, pos; // `pos` is a character (not byte) index like in pqmarkup_lite.py
 
-    Exception(const std::string &message, int line, int column, int pos) :
+    Exception(const std::string &message, size_t line, size_t column, size_t pos) :
         message(message), line(line), column(column), pos(pos) {}
 };
 
@@ -75,18 +98,74 @@ std::string html_escapeq(std::string_view sv)
 	return s;
 }
 
+void append_html_escaped(std::string &out, std::string_view sv)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < sv.length(); i++)
+        if (sv[i] == '&' || sv[i] == '<') {
+            out.append(sv.data() + start, i - start);
+            out += sv[i] == '&' ? "&amp;" : "&lt;";
+            start = i + 1;
+        }
+    out.append(sv.data() + start, sv.length() - start);
+}
+
+void append_html_escapedq(std::string &out, std::string_view sv)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < sv.length(); i++)
+        if (sv[i] == '&' || sv[i] == '"') {
+            out.append(sv.data() + start, i - start);
+            out += sv[i] == '&' ? "&amp;" : "&quot;";
+            start = i + 1;
+        }
+    out.append(sv.data() + start, sv.length() - start);
+}
+
+// Appends `sv` escaped for a JSON string (without quotes)
+void append_json_escaped(std::string &out, std::string_view sv)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < sv.length(); i++)
+        if (sv[i] == '"' || sv[i] == '\\' || (unsigned char)sv[i] < 0x20) {
+            out.append(sv.data() + start, i - start);
+            char esc[8];
+            switch (sv[i])
+            {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)sv[i]);
+                out += esc;
+            }
+            start = i + 1;
+        }
+    out.append(sv.data() + start, sv.length() - start);
+}
+
+// Appends `sv` as a JSON string (in quotes)
+void append_json_string(std::string &out, std::string_view sv)
+{
+    out += '"';
+    append_json_escaped(out, sv);
+    out += '"';
+}
+
 /*std::string_view substr(const std::string &s, int start, int end)
 {
     return std::string_view(s).substr(start, end - start);
 }*/
-std::string_view substr(std::string_view sv, int start, int end)
+std::string_view substr(std::string_view sv, ptrdiff_t start, ptrdiff_t end)
 {
     return sv.substr(start, end - start);
 }
 
 bool starts_with(const std::string &str, const char *s, size_t sz)
 {
-    return str.length() >= (int)sz && memcmp(str.data(), s, sz*sizeof(char)) == 0;
+    return str.length() >= sz && memcmp(str.data(), s, sz*sizeof(char)) == 0;
 }
 template <int N> bool starts_with(const std::string &str, const char (&s)[N])
 {
@@ -109,8 +188,500 @@ template <int N> bool in(char c, const char(&s)[N])
     return false;
 }
 
+// Map from offsets in the output back to offsets in the input: runs of output bytes copied from the input, ordered by output offset.
+// Each run is stored as three varints: its output offset minus the end of the previous run in the output, its input offset
+// minus the end of the previous run in the input (zigzag-encoded, as it can be negative) and its length.
+// Output bytes between runs come from markup (tags, entities, bullets and so on). Input offsets do not count a UTF-8 BOM.
+// Lookups start decoding at a checkpoint saved every `checkpoint_interval` runs, so they do not depend on the size of the map.
+class SourceMap
+{
+    std::string data;
+    size_t out_end = 0, in_end = 0; // of the last run
+
+    static const size_t checkpoint_interval = 64;
+    struct Checkpoint
+    {
+        size_t pos, out_end, in_end; // offset in `data` of the first run of the block and the ends of the run preceding it
+        size_t in_max_end; // the largest end in the input of the runs up to the end of the block (runs are not ordered by input offset)
+    };
+    std::vector<Checkpoint> checkpoints;
+    size_t runs_count = 0;
+
+    void put(uint64_t v)
+    {
+        for (; v >= 0x80; v >>= 7)
+            data += char(v | 0x80);
+        data += char(v);
+    }
+
+public:
+    struct Run
+    {
+        size_t out, in, length;
+    };
+
+    void add(size_t out, size_t in, size_t length)
+    {
+        assert(out >= out_end);
+        if (length == 0)
+            return;
+        if (runs_count++ % checkpoint_interval == 0)
+            checkpoints.push_back({data.size(), out_end, in_end, checkpoints.empty() ? 0 : checkpoints.back().in_max_end});
+        int64_t in_delta = int64_t(in) - int64_t(in_end);
+        put(out - out_end);
+        put(uint64_t(in_delta) << 1 ^ uint64_t(in_delta >> 63));
+        put(length);
+        out_end = out + length;
+        in_end = in + length;
+        checkpoints.back().in_max_end = std::max(checkpoints.back().in_max_end, in_end);
+    }
+
+private:
+    // Calls `f(const Run&)` for each run starting at checkpoint `cp` while it returns true
+    template <class F> void decode(const Checkpoint &cp, F &&f) const
+    {
+        size_t p = cp.pos;
+        auto get = [this, &p] {
+            uint64_t v = 0;
+            for (int shift = 0;; shift += 7) {
+                unsigned char b = data[p++];
+                v |= uint64_t(b & 0x7F) << shift;
+                if (b < 0x80)
+                    return v;
+            }
+        };
+        Run r = {cp.out_end, cp.in_end, 0};
+        while (p < data.length()) {
+            r.out += r.length + get();
+            uint64_t zz = get();
+            r.in += r.length + (int64_t)(zz >> 1 ^ (~(zz & 1) + 1));
+            r.length = get();
+            if (!f(static_cast<const Run&>(r)))
+                return;
+        }
+    }
+
+public:
+    // Calls `f(const Run&)` for each run
+    template <class F> void for_each(F &&f) const
+    {
+        if (!checkpoints.empty())
+            decode(checkpoints.front(), [&f](const Run &r) {f(r); return true;});
+    }
+
+    // Returns the input offset from which output byte `out` was copied (or the end of the preceding run for markup)
+    size_t to_input(size_t out) const
+    {
+        // The last block starting at or before `out`: the run containing `out` or preceding it is in this block or ends just before it
+        auto cp = std::upper_bound(checkpoints.begin(), checkpoints.end(), out, [](size_t out, const Checkpoint &c) {return out < c.out_end;});
+        if (cp == checkpoints.begin())
+            return 0;
+        --cp;
+        size_t result = cp->in_end;
+        decode(*cp, [&](const Run &r) {
+            if (r.out > out)
+                return false;
+            result = out < r.out + r.length ? r.in + (out - r.out) : r.in + r.length;
+            return true;
+        });
+        return result;
+    }
+
+    // Returns the first output offset to which input byte `in` (or a later one) was copied
+    size_t to_output(size_t in) const
+    {
+        // This is in the first run (in output order) ending after `in`, as runs do not overlap in the output
+        auto cp = std::upper_bound(checkpoints.begin(), checkpoints.end(), in, [](size_t in, const Checkpoint &c) {return in < c.in_max_end;});
+        size_t result = out_end;
+        if (cp != checkpoints.end())
+            decode(*cp, [&](const Run &r) {
+                if (r.in + r.length <= in)
+                    return true;
+                result = r.out + (r.in > in ? 0 : in - r.in);
+                return false;
+            });
+        return result;
+    }
+
+    const std::string &encoded() const {return data;}
+
+    void clear()
+    {
+        data.clear();
+        out_end = in_end = 0;
+        checkpoints.clear();
+        runs_count = 0;
+    }
+};
+
+// Result of conversion: a rope of pieces which point into the input document, at string literals or at small buffers owned by the Output
+class Output
+{
+    std::vector<std::string_view> pieces;
+    size_t total_size = 0;
+    std::vector<std::string> buffers; // storage for pieces which are neither parts of the input nor literals (never reallocated while in use)
+    size_t cur_buffer = 0;
+
+public:
+    // `s` must stay alive as long as the output is used
+    void write(std::string_view s)
+    {
+        if (s.empty())
+            return;
+        total_size += s.length();
+        if (!pieces.empty() && pieces.back().data() + pieces.back().length() == s.data())
+            pieces.back() = std::string_view(pieces.back().data(), pieces.back().length() + s.length());
+        else
+            pieces.push_back(s);
+    }
+
+    // Stores a copy of `s` which lives as long as the output (until `clear()`)
+    std::string_view copy(std::string_view s)
+    {
+        if (s.empty())
+            return s;
+        if (cur_buffer < buffers.size() && buffers[cur_buffer].capacity() - buffers[cur_buffer].length() < s.length())
+            cur_buffer++;
+        if (cur_buffer == buffers.size())
+            buffers.emplace_back();
+        std::string &b = buffers[cur_buffer];
+        if (b.capacity() - b.length() < s.length() || b.capacity() < 4096) { // a new or a too small buffer (a short string is stored inside the std::string object and would move with it)
+            assert(b.empty());
+            b.reserve(std::max(s.length(), (size_t)4096));
+        }
+        b.append(s);
+        return std::string_view(b.data() + b.length() - s.length(), s.length());
+    }
+
+    void write_copy(std::string_view s)
+    {
+        write(copy(s));
+    }
+
+    // Appends an empty piece to be filled in later by `fill_slot()` and returns its index
+    size_t write_slot()
+    {
+        pieces.push_back(std::string_view());
+        return pieces.size() - 1;
+    }
+
+    void fill_slot(size_t slot, std::string_view s)
+    {
+        assert(pieces[slot].empty());
+        pieces[slot] = s;
+        total_size += s.length();
+    }
+
+    void write_escaped(std::string_view s) // html_escape()
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < s.length(); i++)
+            if (s[i] == '&' || s[i] == '<') {
+                write(s.substr(start, i - start));
+                write(s[i] == '&' ? "&amp;" : "&lt;");
+                start = i + 1;
+            }
+        write(s.substr(start));
+    }
+
+    void write_escapedq(std::string_view s) // html_escapeq()
+    {
+        size_t start = 0;
+        for (size_t i = 0; i < s.length(); i++)
+            if (s[i] == '&' || s[i] == '"') {
+                write(s.substr(start, i - start));
+                write(s[i] == '&' ? "&amp;" : "&quot;");
+                start = i + 1;
+            }
+        write(s.substr(start));
+    }
+
+    size_t size() const {return total_size;}
+    const std::vector<std::string_view> &get_pieces() const {return pieces;}
+
+    // Adds pieces which point into `input` to `map` (`out_offset` is the offset of this output in the whole output)
+    void add_to_source_map(SourceMap &map, std::string_view input, size_t out_offset = 0) const
+    {
+        for (auto &&p : pieces) {
+            uintptr_t start = (uintptr_t)p.data() - (uintptr_t)input.data(); // wraps around for pieces before `input`
+            if (start < input.length() && p.length() <= input.length() - start)
+                map.add(out_offset, start, p.length());
+            out_offset += p.length();
+        }
+    }
+
+    // Appends bytes [`start`, `end`) of the output to `s`
+    void append_range_to(std::string &s, size_t start, size_t end) const
+    {
+        size_t pos = 0;
+        for (auto &&p : pieces) {
+            if (pos + p.length() > start && pos < end)
+                s.append(p.substr(start > pos ? start - pos : 0, end - pos));
+            pos += p.length();
+        }
+    }
+
+    void clear()
+    {
+        pieces.clear();
+        total_size = 0;
+        for (size_t b = 0; b < buffers.size() && b <= cur_buffer; b++)
+            buffers[b].clear();
+        cur_buffer = 0;
+    }
+
+    void append_to(std::string &s) const
+    {
+        s.reserve(s.length() + total_size);
+        for (auto &&p : pieces)
+            s += p;
+    }
+
+    // Calls `f(std::string_view)` for each piece of the output in order
+    template <class Func> void for_each_piece(Func &&f) const
+    {
+        for (auto &&p : pieces)
+            f(p);
+    }
+
+    std::string str() const
+    {
+        std::string s;
+        append_to(s);
+        return s;
+    }
+
+    bool write_to(FILE *f) const
+    {
+        for (auto &&p : pieces)
+            if (!p.empty() && fwrite(p.data(), p.length(), 1, f) != 1)
+                return false;
+        return true;
+    }
+
+#ifndef _WIN32
+    // Writes all pieces to a file or a socket with scatter-gather I/O
+    bool write_to(int fd) const
+    {
+#ifdef IOV_MAX
+        const int max_iov = IOV_MAX < 1024 ? IOV_MAX : 1024;
+#else
+        const int max_iov = 1024;
+#endif
+        iovec iov[1024];
+        for (size_t p = 0; p < pieces.size();) {
+            int n = 0;
+            for (; n < max_iov && p < pieces.size(); n++, p++)
+                iov[n] = {const_cast<char*>(pieces[p].data()), pieces[p].length()};
+            iovec *v = iov;
+            while (n > 0) {
+                ssize_t written = writev(fd, v, n);
+                if (written < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    return false;
+                }
+                for (; n > 0 && (size_t)written >= v->iov_len; v++, n--)
+                    written -= v->iov_len;
+                if (n > 0) {
+                    v->iov_base = (char*)v->iov_base + written;
+                    v->iov_len -= written;
+                }
+            }
+        }
+        return true;
+    }
+#endif
+};
+
+// Output which discards everything written to it (for validation, which runs the conversion only for its errors)
+class NullOutput
+{
+public:
+    void write(std::string_view) {}
+    void write_copy(std::string_view) {}
+    void write_escaped(std::string_view) {}
+    void write_escapedq(std::string_view) {}
+    size_t size() const {return 0;}
+    void append_range_to(std::string &, size_t, size_t) const {}
+};
+
+// Plain text of the result for full-text search: the text content of the HTML (tags are removed and entities decoded),
+// but text runs of the document are appended as is instead of being escaped and decoded back.
+// Optionally the target of each link is written after the link text (as ` (href)`) and `block_separator` is written
+// at the start and at the end of headers, blockquotes and divs, at `<pre>` code blocks and at line breaks.
+class TextOutput
+{
+    std::string text, tag; // `tag` is the tag being written (tags can be written in several pieces)
+    size_t html_size = 0; // the converter checks only if it changes
+    std::string href; // of the last link
+
+    void end_tag()
+    {
+        static const std::string_view block_tags[] = {"br", "blockquote", "div", "h1", "h2", "h3", "h4", "h5", "h6"};
+        bool closing = tag[1] == '/';
+        std::string_view name = std::string_view(tag).substr(1 + closing);
+        name = name.substr(0, std::find_if(name.begin(), name.end(), [](char c) {return !isalnum((unsigned char)c);}) - name.begin());
+        if (name == "a" && !closing) {
+            size_t start = tag.find("href=\"");
+            href.clear();
+            if (start != tag.npos)
+                decode_entities(href, std::string_view(tag).substr(start + 6, tag.find('"', start + 6) - start - 6));
+        }
+        else if (name == "a" && write_hrefs)
+            text += " (" + href + ")";
+        else if (!block_separator.empty() && (std::find(std::begin(block_tags), std::end(block_tags), name) != std::end(block_tags) || tag == "<pre>" || tag == "</pre>"))
+            text += block_separator;
+        tag.clear();
+    }
+
+    static void decode_entities(std::string &out, std::string_view s)
+    {
+        static const std::pair<std::string_view, std::string_view> entities[] = {{"&amp;", "&"}, {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&emsp;", u8"\u2003"}};
+        for (size_t amp; (amp = s.find('&')) != s.npos;) {
+            out.append(s.data(), amp);
+            s.remove_prefix(amp);
+            auto e = std::find_if(std::begin(entities), std::end(entities), [s](auto &&e) {return s.substr(0, e.first.length()) == e.first;});
+            out += e != std::end(entities) ? e->second : "&";
+            s.remove_prefix(e != std::end(entities) ? e->first.length() : 1);
+        }
+        out.append(s.data(), s.length());
+    }
+
+public:
+    bool write_hrefs = false;
+    std::string block_separator;
+
+    // `s` is HTML
+    void write(std::string_view s)
+    {
+        html_size += s.length();
+        while (!s.empty()) {
+            if (!tag.empty()) {
+                size_t end = s.find('>');
+                tag.append(s.data(), std::min(end, s.length()));
+                if (end == s.npos)
+                    return;
+                tag += '>';
+                end_tag();
+                s.remove_prefix(end + 1);
+                continue;
+            }
+            size_t lt = 0;
+            while ((lt = s.find('<', lt)) != s.npos && !(lt + 1 < s.length() && (isalpha((unsigned char)s[lt + 1]) || s[lt + 1] == '/'))) // as in browsers, `<` not followed by a tag name is text
+                lt++;
+            decode_entities(text, s.substr(0, lt));
+            if (lt == s.npos)
+                return;
+            tag = '<';
+            s.remove_prefix(lt + 1);
+        }
+    }
+
+    void write_copy(std::string_view s) {write(s);}
+
+    void write_escaped(std::string_view s) // text
+    {
+        html_size += s.length();
+        if (!tag.empty())
+            tag.append(s.data(), s.length());
+        else
+            text.append(s.data(), s.length());
+    }
+
+    void write_escapedq(std::string_view s) // an attribute value (or text of a link without text)
+    {
+        if (tag.empty()) {
+            write_escaped(s);
+            return;
+        }
+        html_size += s.length();
+        for (char c : s) // the value is decoded by `end_tag()`
+            if (c == '&')
+                tag += "&amp;";
+            else if (c == '"')
+                tag += "&quot;";
+            else
+                tag += c;
+    }
+
+    size_t size() const {return html_size;}
+    void append_range_to(std::string &, size_t, size_t) const {}
+
+    const std::string &str() const {return text;}
+
+    void clear()
+    {
+        text.clear();
+        html_size = 0;
+    }
+};
+
+// Finds beginnings of lines at which a document can be split into parts that are converted independently:
+// lines outside of any ‘...’, [...] and code span (and not following `’\n`, as this newline can be consumed
+// by a closing header or blockquote leaving `new_line_tag` set until the next one). This is a heuristic (e.g. brackets inside a link URL or a comment
+// are not recognized), so a part must still be checked by converting it.
+class SafePointScanner
+{
+    size_t pos = 0;
+    size_t quote_balance = 0, sq_bracket_depth = 0;
+    size_t code_span = 0; // length of the run of backticks which opened the current code span
+
+public:
+    // Returns the first safe point at or after `min_pos` (or the end of `s`).
+    // If `s` is not final (more input can follow), a run of backticks or a quote at the end of `s` is left unscanned
+    // and `npos` is returned when there is no safe point yet.
+    size_t next(std::string_view s, size_t min_pos, bool final = true)
+    {
+        while (pos < s.length()) {
+            char c = s[pos];
+            if (c == '`') {
+                size_t start = pos;
+                while (++pos < s.length() && s[pos] == '`');
+                if (!final && pos == s.length()) {
+                    pos = start;
+                    return std::string_view::npos;
+                }
+                if (code_span == 0)
+                    code_span = pos - start;
+                else if (pos - start >= code_span)
+                    code_span = pos - start - code_span; // the rest of the run opens a new code span
+                continue;
+            }
+            if (c == u8"‘"[0] && !final && pos + 2 >= s.length())
+                return std::string_view::npos;
+            if (c == u8"‘"[0] && pos + 2 < s.length() && s[pos + 1] == u8"‘"[1] && (s[pos + 2] == u8"‘"[2] || s[pos + 2] == u8"’"[2])) { // ’
+                if (s[pos + 2] == u8"‘"[2]) // ’
+                    quote_balance++;
+                else if (quote_balance > 0) // an unpaired `’` is an error anyway, so it should not prevent splitting the rest of the document
+                    quote_balance--;
+                pos += 3;
+                continue;
+            }
+            if (code_span == 0) {
+                if (c == '[')
+                    sq_bracket_depth++;
+                else if (c == ']' && sq_bracket_depth > 0)
+                    sq_bracket_depth--;
+            }
+            pos++;
+            if (c == '\n' && pos >= min_pos && quote_balance == 0 && sq_bracket_depth == 0 && code_span == 0
+                    && !(pos >= 4 && s[pos - 2] == u8"’"[2] && s[pos - 3] == u8"’"[1] && s[pos - 4] == u8"’"[0]))
+                return pos;
+        }
+        return final ? s.length() : std::string_view::npos;
+    }
+
+    // Must be called when the first `n` bytes of the scanned text are discarded
+    void shift(size_t n)
+    {
+        assert(pos >= n);
+        pos -= n;
+    }
+};
+
 // [https://github.com/nim-lang/Nim/blob/version-1-4/lib/pure/unicode.nim#L54 <- https://nim-lang.org/docs/unicode.html]
-int rune_len_at(const std::string_view s, int i)
+int rune_len_at(const std::string_view s, size_t i)
 {
     unsigned c = (unsigned char)s[i];
     if (c <= 127) return 1;
@@ -123,144 +694,578 @@ int rune_len_at(const std::string_view s, int i)
 #endif
 }
 
+// Bytes which can start markup outside of the beginning of a line: `‘`, `’` (0xE2 is their first byte), ` [ ] { } and new line
+const struct MarkupChars
+{
+    bool table[256] = {};
+    MarkupChars()
+    {
+        for (unsigned char c : {(unsigned char)0xE2, (unsigned char)'`', (unsigned char)'[', (unsigned char)']', (unsigned char)'{', (unsigned char)'}', (unsigned char)'\n'})
+            table[c] = true;
+    }
+    bool operator[](unsigned char c) const {return table[c];}
+} markup_chars;
+
+// Returns the position of the first byte of `s` at or after `i` which is in `markup_chars` (or the length of `s`)
+size_t find_markup_char(std::string_view s, size_t i)
+{
+#if defined(__SSE2__) || defined(_M_X64)
+    // 16 bytes at a time: `[` `]` `{` `}` differ only in bit 5, so two comparisons cover them
+    const __m128i lead = _mm_set1_epi8((char)0xE2), backtick = _mm_set1_epi8('`'), new_line = _mm_set1_epi8('\n'),
+                  bit5 = _mm_set1_epi8(0x20), open = _mm_set1_epi8('{'), close = _mm_set1_epi8('}');
+    for (; i + 16 <= s.length(); i += 16) {
+        __m128i b = _mm_loadu_si128((const __m128i*)(s.data() + i));
+        __m128i b5 = _mm_or_si128(b, bit5);
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(b, lead), _mm_cmpeq_epi8(b, backtick)),
+                                                                 _mm_or_si128(_mm_cmpeq_epi8(b, new_line),
+                                                                              _mm_or_si128(_mm_cmpeq_epi8(b5, open), _mm_cmpeq_epi8(b5, close)))));
+        if (mask != 0) {
+#ifdef _MSC_VER
+            unsigned long n;
+            _BitScanForward(&n, mask);
+            return i + n;
+#else
+            return i + __builtin_ctz(mask);
+#endif
+        }
+    }
+#endif
+    while (i < s.length() && !markup_chars[(unsigned char)s[i]])
+        i++;
+    return i;
+}
+
+// Returns the position in the document of the start of a nested `to_html()` call from the positions of the calls it is nested in
+ptrdiff_t nested_call_offset(const std::vector<ptrdiff_t> &outer_positions)
+{
+    return std::accumulate(outer_positions.begin(), outer_positions.end(), ptrdiff_t(0)); // not `0`, which would sum in `int`
+}
+
+// Converter keeps the state of the conversion in progress (the document, its index, the tag stack...) in its members, so an instance
+// can be used by only one thread at a time. SharedConverter is the front end for threads sharing the same settings.
 class Converter
 {
-    std::vector<int> to_html_called_inside_to_html_outer_pos_arr;
+    std::vector<ptrdiff_t> to_html_called_inside_to_html_outer_pos_arr;
     bool ohd;
     std::string_view instr;
+    size_t base_line = 0, base_cpos = 0; // number of lines and characters preceding `instr` (when it is a part of a document)
+    ptrdiff_t error_offset = 0; // position in `instr` of the last error
 
-public:
-    Converter(bool ohd) : ohd(ohd) {}
-
-    std::string to_html(std::string_view instr, FILE *outfilef = NULL, int outer_pos = 0)
+    // Tokens and index of the whole document built by `tokenize()` before conversion (positions are relative to `this->instr`).
+    // The parser visits only positions of tokens, beginnings of lines and `writepos` (text between tokens is copied as is),
+    // so a token is 8 bytes (a type and an offset) to keep the array compact.
+    struct Token
     {
-        to_html_called_inside_to_html_outer_pos_arr.push_back(outer_pos);
+        enum Type : unsigned char {QUOTE_OPEN, QUOTE_CLOSE, BACKTICKS, SQ_OPEN, SQ_CLOSE, BRACE_OPEN, BRACE_CLOSE, NEW_LINE, END};
+        uint64_t pos : 56, type : 8; // for BACKTICKS `pos` is the start of a maximal run of backticks
+    };
+    static_assert(sizeof(Token) == 8, "");
+    std::vector<Token> tokens; // in order of position, with an END token at the end of the document
+    std::vector<std::vector<ptrdiff_t>> backtick_runs; // start positions of maximal runs of backticks, bucketed by run length
+    struct QuotePos
+    {
+        ptrdiff_t pos, balance_before; // balance of ‘ and ’ preceding this quote
+    };
+    std::vector<QuotePos> quotes; // all ‘ and ’ of the document and a sentinel at the end
+    struct SqBracket
+    {
+        ptrdiff_t open, close; // `close` is -1 for unpaired `[`
+    };
+    std::vector<SqBracket> sq_brackets; // all `[` of the document in order of appearance with their matching `]`
+    std::vector<ptrdiff_t> sq_brackets_stack;
 
-        std::list<std::string> result; // this should be faster than using regular string
-        size_t result_total_len = 0;
-        auto write = [&result, &result_total_len](std::string &&s) {
-            result_total_len += s.length();
-            result.push_back(std::move(s));
-        };
+    enum class Tag : unsigned char {QUOTE, B, U, S, I, H1, H2, H3, H4, H5, H6, SUP, SUB, NOTE, BLOCKQUOTE};
+    static constexpr const char *opening_tags[] = {"", "<b>", "<u>", "<s>", "<i>", "<h1>", "<h2>", "<h3>", "<h4>", "<h5>", "<h6>", "<sup>", "<sub>", "<div class=\"note\">", "<blockquote>"};
+    static constexpr const char *ending_tags[]  = {u8"’", "</b>", "</u>", "</s>", "</i>", "</h1>", "</h2>", "</h3>", "</h4>", "</h5>", "</h6>", "</sup>", "</sub>", "</div>", "</blockquote>"};
+    std::vector<Tag> ending_tags_stack; // shared by nested calls of to_html(), each of which uses only the part of the stack above the part of the calling one
 
-        if (to_html_called_inside_to_html_outer_pos_arr.size() == 1)
-            this->instr = instr;
+    enum class NewLineTag : unsigned char {BR, NONE, BLOCKQUOTE};
 
-        auto exit_with_error = [this](const std::string &message, int pos)
-        {
-            pos += std::accumulate(to_html_called_inside_to_html_outer_pos_arr.begin(), to_html_called_inside_to_html_outer_pos_arr.end(), 0);
-            int line = 1;
-            int line_start = -1;
-            int t = 0, cpos = 0;
-            while (t < pos) {
-                if (this->instr[t] == '\n') {
-                    line++;
-                    line_start = cpos;
+    ptrdiff_t header_depth = -1; // size of `ending_tags_stack` with the first header opened or -1
+    size_t header_start; // position in the output of the contents of the first header
+
+    // Finds markup characters (see `find_markup_char()`) and fills `tokens` and the index of backtick runs, quotes and brackets
+    void tokenize()
+    {
+        for (auto &&b : backtick_runs)
+            b.clear();
+        tokens.clear();
+        quotes.clear();
+        sq_brackets.clear();
+        sq_brackets_stack.clear();
+        ptrdiff_t balance = 0;
+        auto add = [this](Token::Type type, ptrdiff_t pos) {tokens.push_back({(uint64_t)pos, type});};
+        for (ptrdiff_t i = 0, n = (ptrdiff_t)instr.length(); (i = (ptrdiff_t)find_markup_char(instr, i)) < n;) {
+            switch (instr[i])
+            {
+            case '`': {
+                ptrdiff_t start = i;
+                while (++i < n && instr[i] == '`');
+                if (i - start >= (ptrdiff_t)backtick_runs.size())
+                    backtick_runs.resize(i - start + 1);
+                backtick_runs[i - start].push_back(start);
+                add(Token::BACKTICKS, start);
+                continue;
+            }
+            case '[':
+                sq_brackets_stack.push_back((ptrdiff_t)sq_brackets.size());
+                sq_brackets.push_back({i, -1});
+                add(Token::SQ_OPEN, i);
+                break;
+            case ']':
+                if (!sq_brackets_stack.empty()) {
+                    sq_brackets[sq_brackets_stack.back()].close = i;
+                    sq_brackets_stack.pop_back();
+                }
+                add(Token::SQ_CLOSE, i);
+                break;
+            case '{':
+                add(Token::BRACE_OPEN, i);
+                break;
+            case '}':
+                add(Token::BRACE_CLOSE, i);
+                break;
+            case '\n':
+                add(Token::NEW_LINE, i);
+                break;
+            default: // 0xE2
+                if (i + 2 < n && instr[i + 1] == u8"‘"[1] && (instr[i + 2] == u8"‘"[2] || instr[i + 2] == u8"’"[2])) { // ’
+                    bool open = instr[i + 2] == u8"‘"[2]; // ’
+                    quotes.push_back({i, balance});
+                    balance += open ? 1 : -1;
+                    add(open ? Token::QUOTE_OPEN : Token::QUOTE_CLOSE, i);
+                    i += 3;
+                    continue;
                 }
-                t += rune_len_at(this->instr, t);
-                cpos++;
             }
-            throw Exception(message, line, cpos - line_start, cpos);
-        };
+            i++;
+        }
+        quotes.push_back({(ptrdiff_t)instr.length(), balance});
+        add(Token::END, (ptrdiff_t)instr.length());
+    }
 
-        int i = 0;
-        auto next_char = [&i, &instr](int offset = 1) {
-            return i + offset < instr.length() ? instr[i + offset] : '\0';
-        };
+    std::vector<Token>::const_iterator token_at_or_after(ptrdiff_t pos) const
+    {
+        return std::lower_bound(tokens.begin(), tokens.end(), pos, [](const Token &t, ptrdiff_t pos) {return (ptrdiff_t)t.pos < pos;});
+    }
 
-        auto i_next_str3 = [&i, &instr](const StringLiteral s) {
-            return i + 3 + s.len <= instr.length() && memcmp(instr.data() + i + 3, s.s, s.len) == 0;
-        };
+    std::vector<QuotePos>::const_iterator quote_at_or_after(ptrdiff_t pos) const
+    {
+        return std::lower_bound(quotes.begin(), quotes.end(), pos, [](const QuotePos &q, ptrdiff_t pos) {return q.pos < pos;});
+    }
 
-        auto i_next_str = [&i, &instr](const StringLiteral s) {
-            return i + 1 + s.len <= instr.length() && memcmp(instr.data() + i + 1, s.s, s.len) == 0;
-        };
+    std::vector<SqBracket>::const_iterator sq_bracket_at_or_after(ptrdiff_t pos) const
+    {
+        return std::lower_bound(sq_brackets.begin(), sq_brackets.end(), pos, [](const SqBracket &b, ptrdiff_t pos) {return b.open < pos;});
+    }
 
-        auto ch_is = [&i, &instr](const StringLiteral s) {
-            return i + s.len <= instr.length() && memcmp(instr.data() + i, s.s, s.len) == 0;
-        };
+    // Returns the start of the first run of at least `len` backticks in [`from`, `end`) or -1
+    ptrdiff_t find_backtick_run(ptrdiff_t from, ptrdiff_t end, ptrdiff_t len) const
+    {
+        ptrdiff_t found = -1;
+        for (ptrdiff_t l = len; l < (ptrdiff_t)backtick_runs.size(); l++) {
+            auto it = std::lower_bound(backtick_runs[l].begin(), backtick_runs[l].end(), from);
+            if (it != backtick_runs[l].end() && *it + len <= end && (found == -1 || *it < found))
+                found = *it;
+        }
+        return found;
+    }
 
-        auto prev_char = [&i, &instr](int offset = 1) {
-            return i - offset >= 0 ? instr[i - offset] : '\0';
-        };
+    // Records a `name: value` comment (the first one of each name wins)
+    void add_meta(std::string_view comment)
+    {
+        size_t n = 0;
+        while (n < comment.length() && (isalnum((unsigned char)comment[n]) || comment[n] == '_' || comment[n] == '-'))
+            n++;
+        if (n == 0 || n == comment.length() || comment[n] != ':' || page_info.find_meta(comment.substr(0, n)) != NULL)
+            return;
+        std::string_view value = comment.substr(n + 1);
+        while (!value.empty() && in(value.front(), " \t\r\n"))
+            value.remove_prefix(1);
+        while (!value.empty() && in(value.back(), " \t\r\n"))
+            value.remove_suffix(1);
+        page_info.meta.emplace_back(comment.substr(0, n), value);
+    }
+
+    // Returns the number of ‘ minus the number of ’ lying entirely inside [`start`, `end`)
+    ptrdiff_t quotes_delta(ptrdiff_t start, ptrdiff_t end) const
+    {
+        return end - start >= 3 ? quote_at_or_after(end - 2)->balance_before - quote_at_or_after(start)->balance_before : 0;
+    }
+
+public:
+    Converter(bool ohd) : ohd(ohd) {}
+
+    // Values for placeholders of page templates (see PageTemplate) collected during conversion if `collect_page_info` is set.
+    // They are cleared by `to_html()` and `to_html_streaming()` and at the start of a document by StreamConverter.
+    struct PageInfo
+    {
+        std::string header; // HTML of the contents of the first header
+        std::vector<std::pair<std::string, std::string>> meta; // names and values of `[[[name: value]]]` comments
 
-        int writepos = 0;
-        auto write_to_pos = [&instr, &write, &writepos](int pos, int npos)
+        void clear()
         {
-            write(html_escape(instr.substr(writepos, pos - writepos)));
-            writepos = npos;
-        };
+            header.clear();
+            meta.clear();
+        }
 
-        auto write_to_i = [&i, &write, &instr, &write_to_pos](std::string &&add_str)
+        const std::string *find_meta(std::string_view name) const
         {
-            assert(rune_len_at(instr, i) == 1);
-            write_to_pos(i, i + 1);
-            write(std::move(add_str));
-        };
+            for (auto &&m : meta)
+                if (m.first == name)
+                    return &m.second;
+            return NULL;
+        }
+    } page_info;
+    bool collect_page_info = false;
+    bool compact_ohd = false; // in `ohd` mode write brackets with short class names and without event handlers (for `compact_page_header`)
 
-        auto find_ending_pair_quote = [&exit_with_error, &instr](int i)
+    // Headers and links of a document (see `extract_outline()`)
+    struct Outline
+    {
+        struct Header
         {
-            assert(memcmp(&instr[i], u8"‘", 3) == 0); // ’
-            int startqpos = i;
-            int nesting_level = 0;
-            while (true) {
-                if (i >= instr.length() - 2)
-                    exit_with_error("Unpaired left single quotation mark", startqpos);
-                if (memcmp(&instr[i], u8"‘", 3) == 0)
-                    nesting_level++;
-                else if (memcmp(&instr[i], u8"’", 3) == 0)
-                    if (--nesting_level == 0)
-                        return i;
-                i++;
-            }
+            int level; // 1-6 (as in the HTML tag)
+            std::string text; // source text of the header without comments
+            ptrdiff_t offset; // byte offset of `H` in the document
         };
-
-        auto find_ending_sq_bracket = [&exit_with_error](std::string_view str, int i, int start = 0)
+        struct Link
         {
-            int starti = i;
-            assert(str[i] == '['); // ]
-            int nesting_level = 0;
-            while (true) {
-                switch (str[i])
-                {
-                case '[':
-                    nesting_level++;
-                    break;
-                case ']':
-                    if (--nesting_level == 0)
-                        return i;
-                    break;
+            std::string href, title; // `title` is empty if there is none
+            ptrdiff_t offset; // byte offset of the link text (or of `[` of a quotation source)
+        };
+        std::vector<Header> headers;
+        std::vector<Link> links;
+    };
+
+    // Appends the result to `out` (most of the pieces of the result point into `instr`, so it must outlive `out`)
+    void to_html(std::string_view instr, Output &out)
+    {
+        base_line = base_cpos = 0;
+        page_info.clear();
+        convert_document(instr, out);
+    }
+
+    // Appends the plain text of the result to `out` (see TextOutput).
+    // Brackets are converted as without `ohd`, so that the placeholder of a hidden `{...}` does not get into the text.
+    void to_text(std::string_view instr, TextOutput &out)
+    {
+        const bool ohd = this->ohd;
+        this->ohd = false;
+        base_line = base_cpos = 0;
+        try {
+            convert_document(instr, out);
+        }
+        catch (const Exception &) {
+            this->ohd = ohd;
+            throw;
+        }
+        this->ohd = ohd;
+    }
+
+    // Converts `instr` part by part passing `out` with the result of each part to `flush(out, part_end)` and then clearing it,
+    // so that memory used for output does not depend on the size of the document.
+    // Parts end at safe points (see SafePointScanner) which are at least `part_size` bytes apart.
+    template <class Out, class Flush> void to_html_streaming(std::string_view instr, Out &out, Flush &&flush, size_t part_size = 256*1024)
+    {
+        SafePointScanner scanner;
+        base_line = base_cpos = 0;
+        page_info.clear();
+        for (size_t start = 0; start < instr.length();) {
+            size_t end = scanner.next(instr, start + part_size);
+            while (true) {
+                try {
+                    convert_part(instr.substr(start, end - start), out);
+                    break;
+                }
+                catch (const Exception &) {
+                    if (end == instr.length())
+                        throw;
+                    // Either there is an error in this part or the document can not be split at `end`, so try a larger part
+                    out.clear();
+                    end = scanner.next(instr, start + 2 * (end - start));
                 }
-                i++;
-                if (i == str.length())
-                    exit_with_error("Unended comment started", start + starti);
             }
+            flush(out, end);
+            out.clear();
+            start = end;
+        }
+    }
+
+    // Checks the syntax of `instr` without building any output: throws the same Exception as `to_html()` would
+    void validate(std::string_view instr)
+    {
+        NullOutput out;
+        base_line = base_cpos = 0;
+        convert_document(instr, out);
+    }
+
+    // Collects headers and links of `instr` without building any output: throws the same Exception as `to_html()` would
+    Outline extract_outline(std::string_view instr)
+    {
+        Outline result;
+        NullOutput out;
+        outline = &result;
+        base_line = base_cpos = 0;
+        try {
+            convert_document(instr, out);
+        }
+        catch (const Exception &) {
+            outline = NULL;
+            throw;
+        }
+        outline = NULL;
+        return result;
+    }
+
+    // Checks `instr` like `validate()`, but does not stop at the first error: the construct at fault is made plain text
+    // (see `recover()`) and checking goes on from the safe point preceding the error (see SafePointScanner).
+    // Returns at most `max_errors` errors in the order they are found.
+    std::vector<Exception> diagnose(std::string_view instr, size_t max_errors = 100, size_t part_size = 64*1024)
+    {
+        std::vector<Exception> errors;
+        std::string doc(instr); // recovery edits a copy of the document
+        NullOutput out;
+        base_line = base_cpos = 0;
+        for (size_t start = 0; start < doc.length() && errors.size() < max_errors;) {
+            std::string_view rest = std::string_view(doc).substr(start);
+            SafePointScanner scanner;
+            size_t pos = 0;
+            for (bool failed = false; pos < rest.length() && !failed;) {
+                size_t end = scanner.next(rest, pos + part_size);
+                for (size_t last_error = std::string::npos;;) {
+                    try {
+                        convert_part(rest.substr(pos, end - pos), out);
+                        pos = end;
+                        break;
+                    }
+                    catch (const Exception &e) {
+                        // As in `to_html_streaming()`, the error can be caused by splitting at `end`, so a larger part is tried.
+                        // But an error which stays in place is taken as real without converting the rest of the document.
+                        if (end < rest.length() && e.pos != last_error) {
+                            last_error = e.pos;
+                            end = scanner.next(rest, pos + 2 * (end - pos));
+                            continue;
+                        }
+                        errors.push_back(e);
+                        failed = true;
+                        break;
+                    }
+                }
+            }
+            if (pos == rest.length())
+                break;
+            start += pos;
+            if (!recover(doc, start, start + error_offset, errors.back().message))
+                break;
+        }
+        return errors;
+    }
+
+    std::string to_html(std::string_view instr, FILE *outfilef = NULL)
+    {
+        Output out;
+        to_html(instr, out);
+        if (outfilef == NULL)
+            return out.str();
+        out.write_to(outfilef);
+        return "";
+    }
+
+private:
+    template <class Sink> friend class StreamConverter;
+    friend class SharedConverter;
+
+    Outline *outline = NULL; // filled during conversion by `extract_outline()`
+
+    // Converts a part of a document which starts at `base_line`/`base_cpos` and advances them to the end of the part
+    template <class Out> void convert_part(std::string_view part, Out &out)
+    {
+        convert_document(part, out);
+        for (char c : part) {
+            if (c == '\n')
+                base_line++;
+            if ((c & 0b1100'0000) != 0b1000'0000) // not a continuation byte
+                base_cpos++;
+        }
+    }
+
+    // Makes the construct at `doc[pos]` which caused an error in the part starting at `part_start` plain text:
+    // a quote becomes a double quote, backticks become apostrophes, `[` becomes `(`.
+    // For an unclosed quote the last unpaired `‘` before `pos` is changed, other errors blank out their line.
+    // Characters and lines keep their numbers, so positions of further errors are not affected.
+    // Returns false if there is nothing to change.
+    static bool recover(std::string &doc, size_t part_start, size_t pos, const std::string &message)
+    {
+        auto quote_at = [&doc](size_t p) {
+            return p + 3 <= doc.length() && doc[p] == u8"‘"[0] && doc[p + 1] == u8"‘"[1] && (doc[p + 2] == u8"‘"[2] || doc[p + 2] == u8"’"[2]); // ’
+        };
+        if (message == "Unclosed left single quotation mark somewhere") {
+            std::vector<size_t> unpaired;
+            for (size_t p = part_start; p < pos; p++)
+                if (quote_at(p)) {
+                    if (doc[p + 2] == u8"‘"[2]) // ’
+                        unpaired.push_back(p);
+                    else if (!unpaired.empty())
+                        unpaired.pop_back();
+                    p += 2;
+                }
+            if (!unpaired.empty())
+                pos = unpaired.back();
+        }
+        if (quote_at(pos)) {
+            doc[pos + 2] = doc[pos + 2] == u8"‘"[2] ? u8"“"[2] : u8"”"[2]; // ’
+            return true;
+        }
+        if (pos < doc.length() && doc[pos] == '`') {
+            for (; pos < doc.length() && doc[pos] == '`'; pos++)
+                doc[pos] = '\'';
+            return true;
+        }
+        if (pos < doc.length() && doc[pos] == '[') {
+            doc[pos] = '(';
+            return true;
+        }
+
+        size_t line_start = pos == 0 ? std::string::npos : doc.rfind('\n', pos - 1);
+        line_start = line_start == std::string::npos || line_start < part_start ? part_start : line_start + 1;
+        size_t line_end = std::min(doc.find('\n', line_start), doc.length());
+        std::string blank;
+        for (size_t p = line_start; p < line_end; p += rune_len_at(doc, p))
+            blank += ' ';
+        if (doc.compare(line_start, line_end - line_start, blank) == 0)
+            return false;
+        doc.replace(line_start, line_end - line_start, blank);
+        return true;
+    }
+
+    template <class Out> void convert_document(std::string_view instr, Out &out)
+    {
+        to_html_called_inside_to_html_outer_pos_arr.clear(); // these could be left non-empty by an exception
+        ending_tags_stack.clear();
+        header_depth = -1;
+        to_html(instr, out, 0);
+    }
+
+    template <class Out> void to_html(std::string_view instr, Out &out, ptrdiff_t outer_pos)
+    {
+        to_html_called_inside_to_html_outer_pos_arr.push_back(outer_pos);
+
+        if (to_html_called_inside_to_html_outer_pos_arr.size() == 1) {
+            this->instr = instr;
+            tokenize();
+        }
+        const ptrdiff_t instr_offset = ptrdiff_t(instr.data() - this->instr.data()); // nested calls convert substrings of `this->instr`
+        const ptrdiff_t len = (ptrdiff_t)instr.length();
+        const bool collect_page_info = this->collect_page_info && std::is_same<Out, Output>::value;
+
+        auto exit_with_error = [this](const std::string &message, ptrdiff_t pos)
+        {
+            pos += nested_call_offset(to_html_called_inside_to_html_outer_pos_arr);
+            error_offset = pos;
+            ptrdiff_t line = 1;
+            ptrdiff_t line_start = -1;
+            ptrdiff_t t = 0, cpos = 0;
+            while (t < pos) {
+                if (this->instr[t] == '\n') {
+                    line++;
+                    line_start = cpos;
+                }
+                t += rune_len_at(this->instr, t);
+                cpos++;
+            }
+            throw Exception(message, base_line + line, cpos - line_start, base_cpos + cpos);
+        };
+
+        ptrdiff_t i = 0;
+        auto next_char = [&i, &instr, len](ptrdiff_t offset = 1) {
+            return i + offset < len ? instr[i + offset] : '\0';
+        };
+
+        auto i_next_str3 = [&i, &instr, len](const StringLiteral s) {
+            return i + 3 + s.len <= len && memcmp(instr.data() + i + 3, s.s, s.len) == 0;
         };
 
-        auto remove_comments = [&find_ending_sq_bracket](std::string_view sv, int start, int level = 3) -> std::string
+        auto i_next_str = [&i, &instr, len](const StringLiteral s) {
+            return i + 1 + s.len <= len && memcmp(instr.data() + i + 1, s.s, s.len) == 0;
+        };
+
+        auto ch_is = [&i, &instr, len](const StringLiteral s) {
+            return i + s.len <= len && memcmp(instr.data() + i, s.s, s.len) == 0;
+        };
+
+        auto prev_char = [&i, &instr](ptrdiff_t offset = 1) {
+            return i - offset >= 0 ? instr[i - offset] : '\0';
+        };
+
+        ptrdiff_t writepos = 0;
+        auto write_to_pos = [&instr, &out, &writepos](ptrdiff_t pos, ptrdiff_t npos)
+        {
+            if (pos > writepos) // like `instr[writepos:pos]` in pqmarkup_lite.py, which is empty when `pos < writepos`
+                out.write_escaped(instr.substr(writepos, pos - writepos));
+            writepos = npos;
+        };
+
+        auto write_to_i = [&i, &out, &instr, &write_to_pos](std::string_view add_str) // `add_str` must be a literal
+        {
+            assert(rune_len_at(instr, i) == 1);
+            write_to_pos(i, i + 1);
+            out.write(add_str);
+        };
+
+        // The pair of `‘` at `i` is the first `’` at which the balance of quotes returns to that before `i`
+        auto find_ending_pair_quote = [&exit_with_error, &instr, len, instr_offset, this](ptrdiff_t i)
         {
-			std::string s(sv);
-            std::string brackets(level, '['); // ]
+            assert(memcmp(&instr[i], u8"‘", 3) == 0); // ’
+            auto q = quote_at_or_after(instr_offset + i);
+            assert(q->pos == instr_offset + i);
+            const ptrdiff_t balance = q->balance_before + 1;
             while (true) {
-                size_t j = s.find(brackets);
-                if (j == s.npos)
-                    break;
-                int k = find_ending_sq_bracket(s, (int)j, start) + 1;
-                start += k - (int)j;
-                s.erase(j, k - j);
+                if (++q == quotes.end() || q->pos + 3 > instr_offset + len)
+                    exit_with_error("Unpaired left single quotation mark", i);
+                if (q->balance_before == balance && this->instr[q->pos + 2] == u8"’"[2])
+                    return q->pos - instr_offset;
             }
-            return s;
         };
 
-        std::string link;
+        // Returns the position of `]` matching `[` at `i` (it must be inside `instr` not further than `end`)
+        auto find_ending_sq_bracket = [&exit_with_error, &instr, len, instr_offset, this](ptrdiff_t i, ptrdiff_t end = -1)
+        {
+            assert(instr[i] == '['); // ]
+            auto b = sq_bracket_at_or_after(instr_offset + i);
+            assert(b->open == instr_offset + i);
+            if (b->close == -1 || b->close >= instr_offset + (end == -1 ? len : end))
+                exit_with_error("Unended comment started", i);
+            return b->close - instr_offset;
+        };
 
-        auto write_http_link = [&exit_with_error, &find_ending_pair_quote, &find_ending_sq_bracket, &i, &instr, &link, &i_next_str, &write, &remove_comments, &write_to_pos, this](int startpos, int endpos, int q_offset = 3, std::string text = "")
+        // Passes the parts of `instr[start:end]` outside of comments (`[[[...]]]`) to `write_part`.
+        // An unended comment is an error, unless `lenient` (then the rest is passed as is).
+        auto remove_comments = [&find_ending_sq_bracket, &instr, instr_offset, this](ptrdiff_t start, ptrdiff_t end, auto &&write_part, bool lenient = false)
+        {
+            for (auto b = sq_bracket_at_or_after(instr_offset + start); b != sq_brackets.end() && b->open + 2 < instr_offset + end; ++b) {
+                ptrdiff_t j = b->open - instr_offset;
+                if (j < start || instr[j + 1] != '[' || instr[j + 2] != '[') // ]]
+                    continue;
+                if (lenient && (b->close == -1 || b->close >= instr_offset + end))
+                    break;
+                ptrdiff_t k = find_ending_sq_bracket(j, end) + 1;
+                write_part(substr(instr, start, j));
+                start = k;
+            }
+            write_part(substr(instr, start, end));
+        };
+
+        // Writes `<a href=...>link text</a>` (for a link to the source of a quotation [`quote_source`] only `<a href=...>` is written)
+        auto write_http_link = [&exit_with_error, &find_ending_pair_quote, &find_ending_sq_bracket, &i, &instr, len, instr_offset, &i_next_str, &out, &remove_comments, &write_to_pos, this](ptrdiff_t startpos, ptrdiff_t endpos, ptrdiff_t q_offset = 3, bool quote_source = false)
         { // ‘
             assert(memcmp(&instr[i], u8"’[", 4) == 0 || instr[i] == '['); // ]]
-            int nesting_level = 0;
+            if (!quote_source)
+                write_to_pos(startpos, startpos);
+            ptrdiff_t nesting_level = 0;
             i += 4;
             while (true) {
-                if (i == instr.length())
+                if (i == len)
                     exit_with_error("Unended link", endpos + q_offset);
                 switch (instr[i])
                 {
@@ -279,30 +1284,39 @@ public:
                 i++;
             }
             break_:;
-            link = html_escapeq(substr(instr, endpos + 1 + q_offset, i));
-            auto tag = "<a href=\"" + link + "\"";
-            if (starts_with(link, "./"))
-                tag += " target=\"_self\"";
+            std::string_view link = substr(instr, endpos + 1 + q_offset, i);
+            out.write("<a href=\"");
+            out.write_escapedq(link);
+            out.write("\"");
+            if (link.substr(0, 2) == "./")
+                out.write(" target=\"_self\"");
+            if (outline != NULL)
+                outline->links.push_back({std::string(link), std::string(), instr_offset + startpos});
 
             if (instr[i] == ' ') {
-                tag += " title=\"";
+                out.write(" title=\"");
+                auto write_title = [&out, this](std::string_view part) {
+                    out.write_escapedq(part);
+                    if (outline != NULL)
+                        outline->links.back().title += part;
+                };
                 if (i_next_str(u8"‘")) {
-                    int endqpos2 = find_ending_pair_quote(i + 1); // [[
-                    if (instr[endqpos2 + 3] != ']')
+                    ptrdiff_t endqpos2 = find_ending_pair_quote(i + 1); // [[
+                    if (endqpos2 + 3 >= len || instr[endqpos2 + 3] != ']')
                         exit_with_error("Expected `]` after `’`", endqpos2 + 3);
-                    tag += html_escapeq(remove_comments(substr(instr, i + 4, endqpos2), i + 4));
+                    remove_comments(i + 4, endqpos2, write_title);
                     i = endqpos2 + 3;
                 }
                 else {
-                    int endb = find_ending_sq_bracket(instr, endpos + q_offset);
-                    tag += html_escapeq(remove_comments(substr(instr, i + 1, endb), i + 1));
+                    ptrdiff_t endb = find_ending_sq_bracket(endpos + q_offset);
+                    remove_comments(i + 1, endb, write_title);
                     i = endb;
                 }
-                tag += "\"";
+                out.write("\"");
             }
             if (i_next_str(u8"[-")) {
-                int j = i + 3;
-                while (j < instr.length()) {
+                ptrdiff_t j = i + 3;
+                while (j < len) {
                     if (instr[j] == ']') {
                         i = j;
                         break;
@@ -312,100 +1326,120 @@ public:
                     j++;
                 }
             }
-            if (text.empty()) {
+            out.write(">");
+            if (!quote_source) {
                 write_to_pos(startpos, i + 1);
-                text = to_html(substr(instr, startpos + q_offset, endpos), nullptr, startpos + q_offset);
+                size_t size_before = out.size();
+                to_html(substr(instr, startpos + q_offset, endpos), out, startpos + q_offset);
+                if (out.size() == size_before)
+                    out.write_escapedq(link);
+                out.write("</a>");
             }
-            write(tag + ">" + (!text.empty() ? text : link) + "</a>");
         };
 
-        auto write_abbr = [&exit_with_error, &find_ending_pair_quote, &i, &instr, &write, &remove_comments, &write_to_pos](int startpos, int endpos, int q_offset = 3)
+        auto write_abbr = [&exit_with_error, &find_ending_pair_quote, &i, &instr, len, &out, &remove_comments, &write_to_pos](ptrdiff_t startpos, ptrdiff_t endpos, ptrdiff_t q_offset = 3)
         {
             i += q_offset;
-            int endqpos2 = find_ending_pair_quote(i + 1); // [[
-            if (instr[endqpos2 + 3] != ']') // ‘
+            ptrdiff_t endqpos2 = find_ending_pair_quote(i + 1); // [[
+            if (endqpos2 + 3 >= len || instr[endqpos2 + 3] != ']') // ‘
                 exit_with_error("Bracket ] should follow after ’", endqpos2 + 3);
             write_to_pos(startpos, endqpos2 + 4);
-            write("<abbr title=\"" + html_escapeq(remove_comments(substr(instr, i + 4, endqpos2), i + 4)) + "\">" + html_escape(remove_comments(substr(instr, startpos + q_offset, endpos), startpos + q_offset)) + "</abbr>");
+            out.write("<abbr title=\"");
+            remove_comments(i + 4, endqpos2, [&out](std::string_view part) {out.write_escapedq(part);});
+            out.write("\">");
+            remove_comments(startpos + q_offset, endpos, [&out](std::string_view part) {out.write_escaped(part);});
+            out.write("</abbr>");
             i = endqpos2 + 3;
         };
 
-        std::vector<std::string> ending_tags;
-        std::string new_line_tag = std::string(1, '\0');
+        const size_t ending_tags_base = ending_tags_stack.size();
+        auto ending_tags_empty = [this, ending_tags_base]() {return ending_tags_stack.size() == ending_tags_base;};
+        NewLineTag new_line_tag = NewLineTag::BR;
+        auto token = token_at_or_after(instr_offset);
 
-        while (i < instr.length()) {
+        while (i < len) {
             char ch = instr[i];
-            if ((i == 0 || prev_char() == '\n' || (i == writepos && !ending_tags.empty() && in(ending_tags.back(), "</blockquote>", "</div>")) && in(instr.substr(i - 4, 4), u8">‘", u8"<‘", u8"!‘"))) { // ’’’
+            if ((i == 0 || prev_char() == '\n' || ((i == writepos && !ending_tags_empty() && in(ending_tags_stack.back(), Tag::BLOCKQUOTE, Tag::NOTE)) && in(instr.substr(i - 4, 4), u8">‘", u8"<‘", u8"!‘")))) { // ’’’
                 if (ch == '.' && next_char() == ' ')
                     write_to_i(u8"•");
                 else if (ch == ' ')
                     write_to_i("&emsp;");
                 else if (in(ch, '>', '<') && (in(next_char(), " [") || i_next_str(u8"‘"))) { // ]’
                     write_to_pos(i, i + 2/* + (i_next_str(u8"‘") ? 2 : 0)*/); // ’
-                    write("<blockquote"s + (ch == '<' ? " class=\"re\"" : "") + ">");
+                    out.write(ch == '<' ? "<blockquote class=\"re\">" : "<blockquote>");
                     if (next_char() == ' ')
-                        new_line_tag = "</blockquote>";
+                        new_line_tag = NewLineTag::BLOCKQUOTE;
                     else {
                         if (next_char() == '[') {
                             if (next_char(2) == '-' && isdigit(next_char(3))) {
-                                i = (int)instr.find(']', i + 4) + 1;
+                                size_t endb = instr.find(']', i + 4);
+                                if (endb == instr.npos) // pqmarkup_lite.py loops forever here
+                                    exit_with_error("Unended comment started", i + 1);
+                                i = (ptrdiff_t)endb + 1;
                             }
                             else {
                                 i++;
-                                int endb = find_ending_sq_bracket(instr, i);
-                                link = substr(instr, i + 1, endb);
+                                ptrdiff_t endb = find_ending_sq_bracket(i);
+                                std::string_view link = substr(instr, i + 1, endb);
                                 size_t spacepos = link.find(' ');
                                 if (spacepos != link.npos)
                                     link = link.substr(0, spacepos);
-                                int link_length = 0, pos46;
-                                for (int i = 0; i < link.length();) {
+                                ptrdiff_t link_length = 0, pos46 = 0;
+                                for (ptrdiff_t i = 0; i < (ptrdiff_t)link.length();) {
                                     link_length++;
                                     i += rune_len_at(link, i);
                                     if (link_length == 46)
                                         pos46 = i;
                                 }
-                                if (link_length > 57)
-                                    link = link.substr(0, link.rfind('/', pos46) + 1) + "...";
-                                write_http_link(i, i, 0, "<i>" + link + "</i>");
+                                write_http_link(i, i, 0, true);
+                                out.write("<i>");
+                                if (link_length > 57) {
+                                    out.write(link.substr(0, link.rfind('/', pos46) + 1));
+                                    out.write("...");
+                                }
+                                else
+                                    out.write(link);
+                                out.write("</i></a>");
                                 i++;
                                 if (instr.substr(i, 4) != u8":‘") // ’
                                     exit_with_error("Quotation with url should always has :‘...’ after [http(s)://url]", i);
-                                write(":<br />\n");
+                                out.write(":<br />\n");
                             }
                         }
                         else {
-                            int endqpos = find_ending_pair_quote(i + 1);
-                            if (instr[endqpos + 3] == '[') { // ]
-                                int startqpos = i + 1;
+                            ptrdiff_t endqpos = find_ending_pair_quote(i + 1);
+                            char after_quote = endqpos + 3 < len ? instr[endqpos + 3] : '\0'; // the quote can end the document (or a part of it)
+                            if (after_quote == '[') { // ]
+                                ptrdiff_t startqpos = i + 1;
                                 i = endqpos;
-                                write("<i>");
+                                out.write("<i>");
                                 assert(writepos == startqpos + 1);
                                 writepos = startqpos;
                                 write_http_link(startqpos, endqpos);
-                                write("</i>");
+                                out.write("</i>");
                                 i++;
                                 if (instr.substr(i, 4) != u8":‘") // ’
                                     exit_with_error("Quotation with url should always has :‘...’ after [http(s)://url]", i);
-                                write(":<br />\n");
+                                out.write(":<br />\n");
                             }
-                            else if (instr[endqpos + 3] == ':') {
-                                write("<i>"); write(std::string(substr(instr, i + 4, endqpos))); write("</i>:<br />\n");
+                            else if (after_quote == ':') {
+                                out.write("<i>"); out.write(substr(instr, i + 4, endqpos)); out.write("</i>:<br />\n");
                                 i = endqpos + 3;
                                 if (instr.substr(i, 4) != u8":‘") // ’
                                     exit_with_error("Quotation with author's name should be in the form >‘Author's name’:‘Quoted text.’", i);
                             }
                         }
                         writepos = i + 4;
-                        ending_tags.push_back("</blockquote>");
+                        ending_tags_stack.push_back(Tag::BLOCKQUOTE);
                     }
                     i++;
-                    i += rune_len_at(instr, i);
+                    i += i < len ? rune_len_at(instr, i) : 1; // `>[-1]` is not checked for the following `:‘`
                     continue;
                 }
             }
 
             if (ch_is(u8"‘")) {
-                int prevci = i - 1;
+                ptrdiff_t prevci = i - 1;
                 char prevc = '\0', prevc2[2] = "\0";
                 if (prevci >= 0) {
                     if ((instr[prevci] & 0b1100'0000) == 0b1000'0000) { // this is a continuation byte
@@ -420,15 +1454,15 @@ public:
                     else
                         prevc = instr[prevci];
                 }
-                int startqpos = i;
+                ptrdiff_t startqpos = i;
                 i = find_ending_pair_quote(i);
-                int endqpos = i;
-                std::string str_in_p; // (
+                ptrdiff_t endqpos = i;
+                std::string_view str_in_p; // (
                 if (prevc == ')') {
                     size_t openp = instr.rfind('(', prevci - 1); // )
                     if (openp != instr.npos && openp > 0) {
-                        str_in_p = substr(instr, (int)openp + 1, startqpos - 1);
-                        prevci = (int)openp - 1;
+                        str_in_p = substr(instr, (ptrdiff_t)openp + 1, startqpos - 1);
+                        prevci = (ptrdiff_t)openp - 1;
                         prevc = instr[prevci];
                         if ((prevc & 0b1100'0000) == 0b1000'0000) { // this is a continuation byte
                             prevci -= 1;
@@ -443,119 +1477,129 @@ public:
                     write_abbr(startqpos, endqpos);
                 else if (in(prevc, "0O") || /*(prevc == u8"О"[0] && prevc2 == u8"О"[1])*/memcmp(prevc2, u8"О", 2) == 0) {
                     write_to_pos(prevci, endqpos + 3);
-                    write(replace_all(html_escape(substr(instr, startqpos + 3, endqpos)), "\n", "<br />\n"));
+                    std::string_view text = substr(instr, startqpos + 3, endqpos);
+                    for (size_t nl; (nl = text.find('\n')) != text.npos; text.remove_prefix(nl + 1)) {
+                        out.write_escaped(text.substr(0, nl));
+                        out.write("<br />\n");
+                    }
+                    out.write_escaped(text);
                 }
                 else if (in(prevc, "<>") && prevci >= 1 && in(instr[prevci - 1], "<>")) {
                     write_to_pos(prevci - 1, endqpos + 3);
-                    auto a = std::string(1, instr[prevci - 1]) + prevc;
-                    write("<div align=\""s + (a == "<<" ? "left" : a == ">>" ? "right" : a == "><" ? "center" : "justify") + "\">" + (to_html(substr(instr, startqpos + 3, endqpos), nullptr, startqpos + 3)) + "</div>\n");
-                    new_line_tag = "";
+                    auto a = instr.substr(prevci - 1, 2);
+                    out.write(a == "<<" ? "<div align=\"left\">" : a == ">>" ? "<div align=\"right\">" : a == "><" ? "<div align=\"center\">" : "<div align=\"justify\">");
+                    to_html(substr(instr, startqpos + 3, endqpos), out, startqpos + 3);
+                    out.write("</div>\n");
+                    new_line_tag = NewLineTag::NONE;
                 }
                 else if (i_next_str3(u8":‘") && instr.substr(find_ending_pair_quote(i + 4) + 3, 1) == "<") {
-                    int endrq = find_ending_pair_quote(i + 4);
+                    ptrdiff_t endrq = find_ending_pair_quote(i + 4);
                     i = endrq + 3;
                     write_to_pos(prevci + 1, i + 1);
-                    write("<blockquote>"); write(to_html(substr(instr, startqpos + 3, endqpos), nullptr, startqpos + 3)); write("<br />\n<div align='right'><i>"); write(std::string(substr(instr, endqpos + 7, endrq))); write("</i></div></blockquote>");
-                    new_line_tag = "";
+                    out.write("<blockquote>"); to_html(substr(instr, startqpos + 3, endqpos), out, startqpos + 3); out.write("<br />\n<div align='right'><i>"); out.write(substr(instr, endqpos + 7, endrq)); out.write("</i></div></blockquote>");
+                    new_line_tag = NewLineTag::NONE;
                 }
                 else {
                     i = startqpos;
                     if (in(prevc, "*_-~")) {
                         write_to_pos(i - 1, i + 3);
-                        char tag = prevc == '*' ? 'b' : prevc == '_' ? 'u' : prevc == '-' ? 's' : 'i';
-                        write("<"s + tag + ">");
-                        ending_tags.push_back("</"s + tag + ">");
+                        Tag tag = prevc == '*' ? Tag::B : prevc == '_' ? Tag::U : prevc == '-' ? Tag::S : Tag::I;
+                        out.write(opening_tags[(int)tag]);
+                        ending_tags_stack.push_back(tag);
                     }
                     else if (prevc == 'H' || /*(prevc == u8"Н"[0] && prevc2 == u8"Н"[1])*/memcmp(prevc2, u8"Н", 2) == 0) {
                         write_to_pos(prevci, i + 3);
                         int h = 0;
-                        if (!str_in_p.empty())
+                        if (!str_in_p.empty()) {
                             if (str_in_p[0] == '-')
                                 h = -(str_in_p[1] - '0');
                             else if (str_in_p[0] == '+')
                                 h = str_in_p[1] - '0';
                             else
                                 h = str_in_p[0] - '0';
-                        auto tag = "h"s + char('0' + std::min(std::max(3 - h, 1), 6));
-                        write("<" + tag + ">");
-                        ending_tags.push_back("</" + tag + ">");
+                        }
+                        Tag tag = Tag((int)Tag::H1 + std::min(std::max(3 - h, 1), 6) - 1);
+                        out.write(opening_tags[(int)tag]);
+                        ending_tags_stack.push_back(tag);
+                        if (collect_page_info && page_info.header.empty() && header_depth == -1) {
+                            header_depth = (ptrdiff_t)ending_tags_stack.size();
+                            header_start = out.size();
+                        }
+                        if (outline != NULL) {
+                            outline->headers.push_back({(int)tag - (int)Tag::H1 + 1, std::string(), instr_offset + prevci});
+                            remove_comments(i + 3, endqpos, [this](std::string_view part) {outline->headers.back().text += part;}, true); // errors in comments are found later
+                        }
                     }
                     else if (prevci >= 1 && in(instr.substr(prevci - 1, 2), "/\\", "\\/")) {
                         write_to_pos(prevci - 1, i + 3);
-                        auto tag = instr.substr(prevci - 1, 2) == "/\\" ? "sup" : "sub";
-                        write("<"s + tag + ">");
-                        ending_tags.push_back("</"s + tag + ">");
+                        bool sup = instr.substr(prevci - 1, 2) == "/\\";
+                        out.write(sup ? "<sup>" : "<sub>");
+                        ending_tags_stack.push_back(sup ? Tag::SUP : Tag::SUB);
                     }
                     else if (prevc == '!') {
                         write_to_pos(prevci, i + 3);
-                        write("<div class=\"note\">");
-                        ending_tags.push_back("</div>");
+                        out.write("<div class=\"note\">");
+                        ending_tags_stack.push_back(Tag::NOTE);
                     }
                     else
-                        ending_tags.push_back(u8"’");
+                        ending_tags_stack.push_back(Tag::QUOTE);
                 }
             }
             else if (ch_is(u8"’")) {
                 write_to_pos(i, i + 3);
-                if (ending_tags.empty())
+                if (ending_tags_empty())
                     exit_with_error("Unpaired right single quotation mark", i);
-                auto last = std::move(ending_tags.back());
-                ending_tags.pop_back();
-                if (next_char(3) == '\n' && (starts_with(last, "</h") || in(last, "</blockquote>", "</div>"))) {
-                    write(std::move(last));
-                    write("\n");
+                Tag last = ending_tags_stack.back();
+                if (header_depth == (ptrdiff_t)ending_tags_stack.size()) {
+                    out.append_range_to(page_info.header, header_start, out.size());
+                    header_depth = -1;
+                }
+                ending_tags_stack.pop_back();
+                if (next_char(3) == '\n' && ((last >= Tag::H1 && last <= Tag::H6) || in(last, Tag::BLOCKQUOTE, Tag::NOTE))) {
+                    out.write(ending_tags[(int)last]);
+                    out.write("\n");
                     i += 3;
                     assert(rune_len_at(instr, writepos) == 1);
                     writepos++;
                 }
                 else
-                    write(std::move(last));
+                    out.write(ending_tags[(int)last]);
             }
             else if (ch == '`') {
-                int start = i;
+                ptrdiff_t start = i;
                 i++;
-                while (i < instr.length()) {
+                while (i < len) {
                     if (instr[i] != '`')
                         break;
                     i++;
                 }
-                size_t end = instr.find(std::string(i - start, '`'), i);
-                if (end == instr.npos)
+                ptrdiff_t end = find_backtick_run(instr_offset + i, instr_offset + len, i - start);
+                if (end == -1)
                     exit_with_error("Unended ` started", start);
-                write_to_pos(start, (int)end + i - start);
-                std::string ins(substr(instr, i, (int)end));
-                int delta = 0;
-                if (ins.length() >= 3)
-                    for (size_t i = 0, n = ins.length() - 2; i < n; i++)
-                        if (memcmp(&ins[i], u8"‘", 3) == 0)
-                            delta++;
-                        else if (memcmp(&ins[i], u8"’", 3) == 0)
-                            delta--;
+                end -= instr_offset;
+                write_to_pos(start, end + i - start);
+                std::string_view ins = substr(instr, i, end);
+                ptrdiff_t delta = quotes_delta(instr_offset + i, instr_offset + end);
                 if (delta > 0)
-                    for (int i = 0; i < delta; i++) // ‘‘
-                        ending_tags.push_back(u8"’");
+                    for (ptrdiff_t i = 0; i < delta; i++) // ‘‘
+                        ending_tags_stack.push_back(Tag::QUOTE);
                 else
-                    for (int i = 0; i < -delta; i++) {
-                        if (ending_tags.back() != u8"’")
+                    for (ptrdiff_t i = 0; i < -delta; i++) {
+                        if (ending_tags_empty() || ending_tags_stack.back() != Tag::QUOTE)
                             exit_with_error("Unpaired single quotation mark found inside code block/span beginning", start);
-                        ending_tags.pop_back();
+                        ending_tags_stack.pop_back();
                     }
-#ifdef _MSC_VER
-                ins = html_escape(std::move(ins)); // this code does not work in GCC for some reason
-#else
-                ins = html_escape(std::string(ins));
-#endif
                 if (ins.find('\n') == ins.npos) {
-                    write("<pre class=\"inline_code\">"); write(std::move(ins)); write("</pre>");
+                    out.write("<pre class=\"inline_code\">"); out.write_escaped(ins); out.write("</pre>");
                 } else {
-                    write("<pre>"); write(std::move(ins)); write("</pre>\n");
-                    new_line_tag = "";
+                    out.write("<pre>"); out.write_escaped(ins); out.write("</pre>\n");
+                    new_line_tag = NewLineTag::NONE;
                 }
-                i = (int)end + i - start - 1;
+                i = end + i - start - 1;
             }
             else if (ch == '[') { // ]
                 if (i_next_str("http") || i_next_str("./") || (i_next_str(u8"‘") && !in(prev_char(), "\r\n\t \0"))) {
-                    int s = i - 1;
+                    ptrdiff_t s = i - 1;
                     while (s >= writepos && !in(instr[s], "\r\n\t [{(")) // )}]
                         s--;
                     if (i_next_str(u8"‘"))
@@ -566,8 +1610,8 @@ public:
                         assert(false);
                 }
                 else if (i_next_str(u8"[[")) { // ]]
-                    int comment_start = i;
-                    int nesting_level = 0;
+                    ptrdiff_t comment_start = i;
+                    ptrdiff_t nesting_level = 0;
                     while (true) {
                         char c = instr[i];
                         if (c == '[')
@@ -577,55 +1621,251 @@ public:
                                 break;
                         }
                         else if (c == u8"‘"[0] && instr[i+1] == u8"‘"[1] && instr[i+2] == u8"‘"[2])
-                            ending_tags.push_back(u8"’");
+                            ending_tags_stack.push_back(Tag::QUOTE);
                         else if (c == u8"’"[0] && instr[i + 1] == u8"’"[1] && instr[i + 2] == u8"’"[2]) {
-                            assert(ending_tags.back() == u8"’");
-                            ending_tags.pop_back();
+                            if (ending_tags_empty() || ending_tags_stack.back() != Tag::QUOTE) // pqmarkup_lite.py fails an assertion here
+                                exit_with_error("Unpaired right single quotation mark", i);
+                            ending_tags_stack.pop_back();
                         }
                         i++;
-                        if (i == instr.length())
+                        if (i == len)
                             exit_with_error("Unended comment started", comment_start);
                     }
                     write_to_pos(comment_start, i + 1);
+                    if (collect_page_info && instr[i - 1] == ']' && instr[i - 2] == ']')
+                        add_meta(substr(instr, comment_start + 3, i - 2));
                 }
                 else
-                    write_to_i((ohd ? "<span class=\"sq\"><span class=\"sq_brackets\">"s : ""s) + "[" + (ohd ? "</span>" : ""));
+                    write_to_i(!ohd ? "[" : compact_ohd ? "<span class=\"s\"><span class=\"b\">[</span>" : "<span class=\"sq\"><span class=\"sq_brackets\">[</span>");
             }
             else if (ch == ']') // [
-                write_to_i((ohd ? "<span class=\"sq_brackets\">"s : ""s) + "]" + (ohd ? "</span></span>" : ""));
+                write_to_i(!ohd ? "]" : compact_ohd ? "<span class=\"b\">]</span></span>" : "<span class=\"sq_brackets\">]</span></span>");
             else if (ch == '{')
-                write_to_i((ohd ? "<span class=\"cu_brackets\" onclick=\"return spoiler(this, event)\"><span class=\"cu_brackets_b\">"s : ""s) + "{" + (ohd ? u8"</span><span>…</span><span class=\"cu\" style=\"display: none\">" : ""));
+                write_to_i(!ohd ? "{" : compact_ohd ? "<span class=\"c\"><span class=\"cb\">{</span><span class=\"h\">"
+                                               : u8"<span class=\"cu_brackets\" onclick=\"return spoiler(this, event)\"><span class=\"cu_brackets_b\">{</span><span>…</span><span class=\"cu\" style=\"display: none\">");
             else if (ch == '}')
-                write_to_i((ohd ? "</span><span class=\"cu_brackets_b\">"s : ""s) + "}" + (ohd ? "</span></span>" : ""));
+                write_to_i(!ohd ? "}" : compact_ohd ? "</span><span class=\"cb\">}</span></span>" : "</span><span class=\"cu_brackets_b\">}</span></span>");
             else if (ch == '\n') {
-                write_to_i((new_line_tag != std::string(1, '\0') ? new_line_tag : "<br />"s) + (new_line_tag != "" ? "\n" : ""));
-                new_line_tag = std::string(1, '\0');
+                write_to_i(new_line_tag == NewLineTag::BR ? "<br />\n" : new_line_tag == NewLineTag::BLOCKQUOTE ? "</blockquote>\n" : "");
+                new_line_tag = NewLineTag::BR;
             }
             i += rune_len_at(instr, i);
+
+            // Skip to the next token (skipped text is written later by `write_to_pos()`).
+            // The start of a line and `writepos` (after `>‘`, `<‘` and `!‘`) are always visited, as they are checked above,
+            // and so are backticks left of a longer run by the end of a code span.
+            if (i != writepos && instr[i - 1] != '\n' && i < len && !markup_chars[(unsigned char)instr[i]]) {
+                while ((ptrdiff_t)token->pos < instr_offset + i)
+                    ++token;
+                i = std::min((ptrdiff_t)token->pos - instr_offset, len);
+            }
         }
 
-        write_to_pos((int)instr.length(), 0);
-        if (!ending_tags.empty())
-            exit_with_error("Unclosed left single quotation mark somewhere", (int)instr.length());
+        write_to_pos(len, 0);
+        if (!ending_tags_empty())
+            exit_with_error("Unclosed left single quotation mark somewhere", len);
         assert(to_html_called_inside_to_html_outer_pos_arr.back() == outer_pos);
         to_html_called_inside_to_html_outer_pos_arr.pop_back();
+    }
+};
 
-        std::string result_str;
-        result_str.reserve(result_total_len);
-        for (auto &&it : result)
-            result_str += it;
+// Resumable conversion of a document which arrives in chunks (e.g. from a pipe or a socket): input is buffered only up to
+// the last safe point (see SafePointScanner), at which everything before is converted and passed to `sink(const Output&)`.
+// Chunks can end anywhere, even inside a UTF-8 sequence. If a part can not be converted on its own (because of an error
+// in it or an unrecognized construct spanning the safe point), more input is buffered until the part has doubled.
+template <class Sink> class StreamConverter
+{
+    Converter converter;
+    Sink sink;
+    Output out;
+    std::string pending; // input after the last converted part
+    SafePointScanner scanner;
+    size_t safe_end = 0, retry_size = 0;
+    bool bom_checked = false;
 
-        if (outfilef == NULL)
-            return result_str;
+    void convert(size_t end)
+    {
+        try {
+            converter.convert_part(std::string_view(pending).substr(0, end), out);
+        }
+        catch (const Exception &) {
+            out.clear();
+            retry_size = 2 * end;
+            return;
+        }
+        sink(static_cast<const Output&>(out));
+        out.clear();
+        pending.erase(0, end);
+        scanner.shift(end);
+        safe_end = retry_size = 0;
+    }
+
+public:
+    StreamConverter(bool ohd, Sink sink) : converter(ohd), sink(std::move(sink)) {}
 
-        fwrite(result_str.data(), result_str.size(), 1, outfilef);
+    Converter &get_converter() {return converter;}
+
+    void feed(std::string_view chunk)
+    {
+        if (!bom_checked && pending.empty())
+            converter.page_info.clear();
+        pending += chunk;
+        if (!bom_checked) {
+            if (pending.length() < 3 && std::string_view("\xEF\xBB\xBF").substr(0, pending.length()) == pending)
+                return;
+            if (pending.compare(0, 3, "\xEF\xBB\xBF") == 0)
+                pending.erase(0, 3);
+            bom_checked = true;
+        }
+        for (size_t p; (p = scanner.next(pending, 0, false)) != std::string_view::npos;)
+            safe_end = p;
+        if (safe_end != 0 && safe_end >= retry_size)
+            convert(safe_end);
+    }
+
+    // Converts the rest of the input (throws Exception on an error in it) and resets the state for a new document
+    void finish()
+    {
+        if (!bom_checked && pending.empty())
+            converter.page_info.clear();
+        if (!bom_checked && pending == "\xEF\xBB\xBF")
+            pending.clear();
+        try {
+            converter.convert_part(pending, out);
+        }
+        catch (const Exception &) {
+            reset();
+            throw;
+        }
+        sink(static_cast<const Output&>(out));
+        reset();
+    }
+
+    void reset()
+    {
+        out.clear();
+        pending.clear();
+        scanner = SafePointScanner();
+        safe_end = retry_size = 0;
+        bom_checked = false;
+        converter.base_line = converter.base_cpos = 0;
+    }
+};
+
+// Conversion settings which can be shared by any number of threads: the `const` methods keep no state in the object, the state
+// of each call lives in a Converter used as its context. The context is either passed by the caller or is the calling thread's
+// own one, which is created on the first call and then reused (with its buffers), so a call costs no construction and no locking.
+// A call made while the thread's context is busy (e.g. from a callback of an outer conversion) gets a temporary context.
+class SharedConverter
+{
+    struct Context
+    {
+        Converter converter{false};
+        Output out; // for the methods which do not take an Output
+    };
+
+    // The calling thread's context for the lifetime of the object (or a temporary one if the thread's context is in use)
+    class ThreadContext
+    {
+        Context *context, *temporary = NULL;
+
+        static Context *&free_context()
+        {
+            thread_local Context context;
+            thread_local Context *free = &context;
+            return free;
+        }
+
+    public:
+        ThreadContext() : context(free_context())
+        {
+            if (context == NULL)
+                context = temporary = new Context;
+            else
+                free_context() = NULL;
+        }
+        ~ThreadContext()
+        {
+            if (temporary == NULL) {
+                if (context->out.size() > 1024*1024) // do not keep the buffers of a large document
+                    context->out = Output();
+                free_context() = context;
+            }
+            delete temporary;
+        }
+        ThreadContext(const ThreadContext&) = delete;
+        Converter &get() {return context->converter;}
+        Output &output()
+        {
+            context->out.clear();
+            return context->out;
+        }
+    };
+
+    template <class Convert> auto with_context(Converter &context, Convert &&convert) const
+    {
+        context.ohd = ohd;
+        context.compact_ohd = compact_ohd;
+        context.collect_page_info = false;
+        return convert(context);
+    }
+
+public:
+    const bool ohd, compact_ohd;
+
+    SharedConverter(bool ohd, bool compact_ohd = false) : ohd(ohd), compact_ohd(compact_ohd) {}
+
+    void to_html(std::string_view instr, Output &out, Converter &context) const
+    {
+        with_context(context, [&](Converter &c) {c.to_html(instr, out);});
+    }
+    void to_html(std::string_view instr, Output &out) const
+    {
+        ThreadContext context;
+        to_html(instr, out, context.get());
+    }
+    std::string to_html(std::string_view instr, FILE *outfilef = NULL) const
+    {
+        ThreadContext context;
+        Output &out = context.output();
+        to_html(instr, out, context.get());
+        if (outfilef == NULL)
+            return out.str();
+        out.write_to(outfilef);
         return "";
     }
+
+    // Writes the result into `buffer` if it fits into `buffer_size` bytes and returns its size (greater than `buffer_size` if
+    // it does not fit). Once the thread's context has warmed up this allocates no memory, e.g. for small documents converted
+    // into a buffer on the stack.
+    size_t to_html(std::string_view instr, char *buffer, size_t buffer_size) const
+    {
+        ThreadContext context;
+        Output &out = context.output();
+        to_html(instr, out, context.get());
+        if (out.size() <= buffer_size)
+            out.for_each_piece([&buffer](std::string_view piece) {
+                memcpy(buffer, piece.data(), piece.length());
+                buffer += piece.length();
+            });
+        return out.size();
+    }
+
+    void validate(std::string_view instr) const
+    {
+        ThreadContext context;
+        with_context(context.get(), [&](Converter &c) {c.validate(instr);});
+    }
+    Converter::Outline extract_outline(std::string_view instr) const
+    {
+        ThreadContext context;
+        return with_context(context.get(), [&](Converter &c) {return c.extract_outline(instr);});
+    }
 };
 
 auto to_html(const std::string &instr, FILE *outfilef = NULL, bool ohd = false)
 {
-    return Converter(ohd).to_html(instr, outfilef);
+    return SharedConverter(ohd).to_html(instr, outfilef);
 }
 
 template <int N> void write_to_file(FILE *file, const char(&s)[N])
@@ -650,90 +1890,99 @@ std::vector<std::string> split(const std::string &s, const std::string &delimite
     return res;
 }
 
-int main(int argc, char *argv[])
+// Contents of an input file without UTF-8 BOM (memory-mapped where possible, so that the output can point into it without copying)
+class InputFile
 {
-    if (argc == 2 && strcmp(argv[1], "-t") == 0) {
-        FILE *tests_file = NULL;
-        fopen_s(&tests_file, "../../tests.txt", "rb");
-        fseek(tests_file, 0, SEEK_END);
-        size_t tests_file_size = ftell(tests_file);
-        fseek(tests_file, 0, SEEK_SET);
-        std::string tests_file_str;
-        tests_file_str.resize(tests_file_size);
-        fread(const_cast<char*>(tests_file_str.data()), tests_file_size, 1, tests_file);
-        fclose(tests_file);
+    std::string buffer;
+#ifndef _WIN32
+    void *mapping = MAP_FAILED;
+    size_t mapping_size = 0;
+#endif
 
-        std::string delim = " (()) ";
+    void set_contents(std::string_view s)
+    {
+        if (s.substr(0, 3) == "\xEF\xBB\xBF")
+            s.remove_prefix(3);
+        contents = s;
+    }
 
-        int tests_cnt = 0;
-        for (auto &&test : split(tests_file_str, "|\n\n|")) {
-            tests_cnt++;
-            size_t delim_pos = test.find(delim);
-            std::string left = test.substr(0, delim_pos),
-                       right = test.substr(delim_pos + delim.length());
-            if (to_html(left) != right) {
-                std::cerr << "Error in test #" << tests_cnt << "\n";
-                return -1;
+public:
+    std::string_view contents;
+
+    InputFile() = default;
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    bool open(const char *fname)
+    {
+#ifndef _WIN32
+        int fd = ::open(fname, O_RDONLY);
+        if (fd == -1)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapping != MAP_FAILED) {
+                mapping_size = st.st_size;
+                madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+                close(fd);
+                set_contents(std::string_view((const char*)mapping, mapping_size));
+                return true;
             }
         }
-        std::cout << "All of " << tests_cnt << " tests are passed!\n";
-        return 0;
+        close(fd);
+#endif
+        FILE *f = NULL;
+        fopen_s(&f, fname, "rb");
+        if (f == NULL)
+            return false;
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            buffer.append(chunk, n);
+        fclose(f);
+        set_contents(buffer);
+        return true;
     }
 
-    if (argc < 3) {
-        std::cout << "Usage: pqmarkup_lite input-file output-file\n";
-        return 0;
+    // Lets the OS drop pages of the file mapping before `pos` (they are reread from the file if they are accessed again)
+    void release_before(size_t pos)
+    {
+#ifndef _WIN32
+        if (mapping == MAP_FAILED)
+            return;
+        size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+        size_t len = (size_t)(contents.data() + pos - (const char*)mapping) / page_size * page_size;
+        if (len > 0)
+            madvise(mapping, len, MADV_DONTNEED);
+#endif
     }
 
-    FILE *infile = NULL;
-    fopen_s(&infile, argv[1], "rb");
-    fseek(infile, 0, SEEK_END);
-    size_t infile_size = ftell(infile);
-    fseek(infile, 0, SEEK_SET);
-
-    std::string file_str;
-    unsigned char utf8bom[3] = {0xEF, 0xBB, 0xBF}, first3bytes[3] = {0};
-    size_t _ = fread(first3bytes, 3, 1, infile);
-    if (memcmp(first3bytes, utf8bom, 3) == 0)
-        infile_size -= 3;
-    else
-        fseek(infile, 0, SEEK_SET);
-    file_str.resize(infile_size);
-    _ = fread(const_cast<char*>(file_str.data()), infile_size, 1, infile);
-    fclose(infile);
-
-    FILE *outfile = NULL;
-    fopen_s(&outfile, argv[2], "wb");
-    write_to_file(outfile, u8R"(<html>
+    ~InputFile()
+    {
+#ifndef _WIN32
+        if (mapping != MAP_FAILED)
+            munmap(mapping, mapping_size);
+#endif
+    }
+};
+
+// HTML page wrapper written around the converted document by the command line interface.
+// `page_header` and `compact_page_header` differ only in the script and the rules for brackets, the rest is shared.
+const char page_head[] = u8R"(<html>
 <head>
 <meta charset="utf-8" />
 <base target="_blank">
 <script type="text/javascript">
-function spoiler(element, event)
-{
-    if (event.target.nodeName == 'A' || event.target.parentNode.nodeName == 'A' || event.target.onclick)//for links in spoilers and spoilers2 in spoilers to work
-        return;
-    var e = element.firstChild.nextSibling.nextSibling;//element.getElementsByTagName('span')[0]
-    e.previousSibling.style.display = e.style.display;//<span>…</span> must have inverted display style
-    e.style.display = (e.style.display == "none" ? "" : "none");
-    element.firstChild.style.fontWeight =
-    element. lastChild.style.fontWeight = (e.style.display == "" ? "normal" : "bold");
-    event.stopPropagation();
-}
-</script>
-<style type="text/css">
-div#main, td {
+)";
+const char page_style_main[] = u8R"(div#main, td {
     font-size: 14px;
     font-family: Verdana, sans-serif;
     line-height: 160%;
     text-align: justify;
 }
-span.cu_brackets_b {
-    font-size: initial;
-    font-family: initial;
-    font-weight: bold;
-}
-a {
+)";
+const char page_style_links_and_headers[] = u8R"(a {
     text-decoration: none;
     color: #6da3bd;
 }
@@ -751,11 +2000,8 @@ h3 {font-size: 160%; line-height: 140%;}
 h4 {font-size: 145%; line-height: 145%;}
 h5 {font-size: 130%; line-height: 140%;}
 h6 {font-size: 120%; line-height: 140%;}
-span.sq {color: gray; font-size: 0.8rem; font-weight: normal; /*pointer-events: none;*/}
-span.sq_brackets {color: #BFBFBF;}
-span.cu_brackets {cursor: pointer;}
-span.cu {background-color: #F7F7FF;}
-abbr {text-decoration: none; border-bottom: 1px dotted;}
+)";
+const char page_style_blocks_and_body[] = u8R"(abbr {text-decoration: none; border-bottom: 1px dotted;}
 pre {margin: 0; font-family: 'Courier New'; line-height: normal;}
 blockquote {
     margin: 0 0 7px 0;
@@ -783,18 +2029,577 @@ div#main {width: 100%;}
 </head>
 <body>
 <div id="main" style="margin: 0 auto">
-)");
+)";
+const std::string page_header = page_head + std::string(u8R"(function spoiler(element, event)
+{
+    if (event.target.nodeName == 'A' || event.target.parentNode.nodeName == 'A' || event.target.onclick)//for links in spoilers and spoilers2 in spoilers to work
+        return;
+    var e = element.firstChild.nextSibling.nextSibling;//element.getElementsByTagName('span')[0]
+    e.previousSibling.style.display = e.style.display;//<span>…</span> must have inverted display style
+    e.style.display = (e.style.display == "none" ? "" : "none");
+    element.firstChild.style.fontWeight =
+    element. lastChild.style.fontWeight = (e.style.display == "" ? "normal" : "bold");
+    event.stopPropagation();
+}
+</script>
+<style type="text/css">
+)")
+    + page_style_main + u8R"(span.cu_brackets_b {
+    font-size: initial;
+    font-family: initial;
+    font-weight: bold;
+}
+)"
+    + page_style_links_and_headers + u8R"(span.sq {color: gray; font-size: 0.8rem; font-weight: normal; /*pointer-events: none;*/}
+span.sq_brackets {color: #BFBFBF;}
+span.cu_brackets {cursor: pointer;}
+span.cu {background-color: #F7F7FF;}
+)"
+    + page_style_blocks_and_body;
+// The same for `Converter::compact_ohd`: spoilers are toggled by one delegated click handler and CSS classes
+const std::string compact_page_header = page_head + std::string(u8R"(document.addEventListener('click', function(event) {
+    var spoiler = event.target.closest('span.c');
+    if (spoiler && !event.target.closest('a'))//for links in spoilers to work
+        spoiler.classList.toggle('o');//the innermost spoiler only
+});
+</script>
+<style type="text/css">
+)")
+    + page_style_main + u8R"(span.cb {
+    font-size: initial;
+    font-family: initial;
+    font-weight: bold;
+}
+)"
+    + page_style_links_and_headers + u8R"(span.s {color: gray; font-size: 0.8rem; font-weight: normal; /*pointer-events: none;*/}
+span.b {color: #BFBFBF;}
+span.c {cursor: pointer;}
+span.h {background-color: #F7F7FF; display: none;}
+span.c.o > span.h {display: inline;}
+span.c.o > span.cb {font-weight: normal;}
+span.c:not(.o) > span.cb:first-child::after {content: "…"; font-weight: normal;}
+)"
+    + page_style_blocks_and_body;
+const char page_footer[] = u8R"(</div>
+</body>
+</html>)";
+
+// 64-bit FNV-1a hash (used to detect changes of files)
+uint64_t fnv1a(std::string_view s, uint64_t h = 14695981039346656037ull)
+{
+    for (unsigned char c : s)
+        h = (h ^ c) * 1099511628211ull;
+    return h;
+}
+
+// Wrapper of converted pages: the built-in one or a template file parsed once into a list of segments. In a template
+// `{{body}}` marks the place of the converted document, `{{header}}` is replaced by the contents of its first header,
+// `{{title}}` by the value of the `[[[title: ...]]]` comment or else by the text of the first header, and `{{name}}`
+// by the value of the `[[[name: ...]]]` comment of the document (empty if there is none).
+class PageTemplate
+{
+    std::string source;
+
+public:
+    struct Segment
+    {
+        enum class Kind : unsigned char {TEXT, BODY, TITLE, HEADER, META} kind;
+        std::string_view text; // the text of a TEXT segment or the name of a META one
+    };
+    std::vector<Segment> segments = {{Segment::Kind::TEXT, std::string_view(page_header)},
+                                     {Segment::Kind::BODY, std::string_view()},
+                                     {Segment::Kind::TEXT, std::string_view(page_footer, sizeof(page_footer) - 1)}};
+    size_t body = 1; // index of the BODY segment
+    bool uses_page_info = false; // there are segments other than TEXT and BODY
+    bool page_info_before_body = false; // ... and some of them precede the body
+    bool compact_ohd = false; // documents are converted with `Converter::compact_ohd`
+
+    PageTemplate() = default;
+    PageTemplate(const PageTemplate &) = delete;
+    PageTemplate &operator=(const PageTemplate &) = delete;
+
+    bool load(const std::string &fname, std::string &error)
+    {
+        FILE *f = NULL;
+        fopen_s(&f, fname.c_str(), "rb");
+        if (f == NULL) {
+            error = "Can't open file '" + fname + "'";
+            return false;
+        }
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+            source.append(chunk, n);
+        fclose(f);
+
+        segments.clear();
+        body = SIZE_MAX;
+        uses_page_info = page_info_before_body = false;
+        std::string_view src = source;
+        size_t text_start = 0;
+        for (size_t pos = src.find("{{"); pos != std::string_view::npos; pos = src.find("{{", pos + 1)) {
+            size_t end = pos + 2;
+            while (end < src.length() && (isalnum((unsigned char)src[end]) || src[end] == '_' || src[end] == '-'))
+                end++;
+            if (end == pos + 2 || src.compare(end, 2, "}}") != 0)
+                continue;
+            std::string_view name = src.substr(pos + 2, end - pos - 2);
+            if (pos > text_start)
+                segments.push_back({Segment::Kind::TEXT, src.substr(text_start, pos - text_start)});
+            if (name == "body") {
+                if (body != SIZE_MAX) {
+                    error = "Template '" + fname + "' has more than one {{body}}";
+                    return false;
+                }
+                body = segments.size();
+                segments.push_back({Segment::Kind::BODY, std::string_view()});
+            }
+            else {
+                segments.push_back({name == "title" ? Segment::Kind::TITLE : name == "header" ? Segment::Kind::HEADER : Segment::Kind::META, name});
+                uses_page_info = true;
+                if (body == SIZE_MAX)
+                    page_info_before_body = true;
+            }
+            text_start = end + 2;
+            pos = end + 1;
+        }
+        if (text_start < src.length())
+            segments.push_back({Segment::Kind::TEXT, src.substr(text_start)});
+        if (body == SIZE_MAX) {
+            error = "Template '" + fname + "' has no {{body}}";
+            return false;
+        }
+        return true;
+    }
+
+    // Appends the value of a placeholder segment to `s`
+    static void append_value(const Segment &segment, const Converter::PageInfo &info, std::string &s)
+    {
+        const std::string *value = segment.kind == Segment::Kind::HEADER ? NULL : info.find_meta(segment.text);
+        if (value != NULL)
+            append_html_escaped(s, *value);
+        else if (segment.kind == Segment::Kind::HEADER)
+            s += info.header;
+        else if (segment.kind == Segment::Kind::TITLE) { // the text of the first header without tags
+            for (size_t i = 0; i < info.header.length(); i++)
+                if (info.header[i] == '<')
+                    i = std::min(info.header.find('>', i), info.header.length());
+                else
+                    s += info.header[i];
+        }
+    }
+
+    // Writes segments [`first`, `last`) to `out` (values of placeholders are copied into `out`, so `info` can change afterwards)
+    void write_segments(size_t first, size_t last, const Converter::PageInfo &info, Output &out) const
+    {
+        std::string value;
+        for (size_t i = first; i < last; i++)
+            if (segments[i].kind == Segment::Kind::TEXT)
+                out.write(segments[i].text);
+            else if (segments[i].kind != Segment::Kind::BODY) {
+                value.clear();
+                append_value(segments[i], info, value);
+                out.write_copy(value);
+            }
+    }
+
+    // Writes the whole page into an empty `out` with the body written by `convert(out)`, which must collect page info
+    // into `info`. Placeholders preceding the body become empty pieces of `out` which are filled in after the conversion.
+    template <class Convert> void write_page(const Converter::PageInfo &info, Output &out, Convert &&convert) const
+    {
+        assert(out.get_pieces().empty());
+        for (size_t i = 0; i < body; i++)
+            if (segments[i].kind == Segment::Kind::TEXT)
+                out.write(segments[i].text);
+            else
+                out.write_slot(); // the index of the slot is `i` as TEXT segments are never empty nor adjacent
+        convert(out);
+        if (page_info_before_body) {
+            std::string value;
+            for (size_t i = 0; i < body; i++)
+                if (segments[i].kind != Segment::Kind::TEXT) {
+                    value.clear();
+                    append_value(segments[i], info, value);
+                    out.fill_slot(i, out.copy(value));
+                }
+        }
+        write_segments(body + 1, segments.size(), info, out);
+    }
+
+    // Identifies the contents of the template (see site_main())
+    // Switches to compact markup of brackets, and the built-in page header to the one with the matching script
+    void set_compact_ohd()
+    {
+        compact_ohd = true;
+        if (source.empty())
+            segments.front().text = std::string_view(compact_page_header);
+    }
+
+    uint64_t fingerprint() const
+    {
+        uint64_t h = fnv1a(compact_ohd ? "compact_ohd" : "");
+        for (auto &&s : segments)
+            h = fnv1a(s.text, fnv1a(std::string_view((const char*)&s.kind, 1), h));
+        return h;
+    }
+};
+
+#include "batch.h"
+#include "site.h"
+#include "jsonl.h"
+
+// Reads input-file `path` of `--check` and `--outline` into `contents` (`-` reads standard input into `input`)
+bool read_input(const char *path, std::string &input, InputFile &infile, std::string_view &contents)
+{
+    if (strcmp(path, "-") == 0) {
+        char chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+            input.append(chunk, n);
+        contents = input;
+        if (contents.substr(0, 3) == "\xEF\xBB\xBF")
+            contents.remove_prefix(3);
+        return true;
+    }
+    if (!infile.open(path)) {
+        std::cerr << "Can't open file '" << path << "'\n";
+        return false;
+    }
+    contents = infile.contents;
+    return true;
+}
+
+// `pqmarkup_lite --check [--max-errors n] input-files...`: reports syntax errors without converting (input-file `-` checks standard input).
+// With `--max-errors` up to `n` errors are reported per file (see `Converter::diagnose()`), otherwise only the first one.
+int check_main(int argc, char *argv[])
+{
+    Converter converter(true);
+    int result = 0;
+    size_t max_errors = 1;
+    for (int a = 0; a < argc; a++) {
+        if (strcmp(argv[a], "--max-errors") == 0 && a + 1 < argc) {
+            max_errors = std::max(atoi(argv[++a]), 1);
+            continue;
+        }
+        std::string input;
+        InputFile infile;
+        std::string_view contents;
+        if (!read_input(argv[a], input, infile, contents)) {
+            result = -1;
+            continue;
+        }
+        std::vector<Exception> errors;
+        if (max_errors > 1)
+            errors = converter.diagnose(contents, max_errors);
+        else
+            try {
+                converter.validate(contents);
+            }
+            catch (const Exception &e) {
+                errors.push_back(e);
+            }
+        for (auto &&e : errors)
+            std::cerr << argv[a] << ": " << e.message << " at line " << e.line << ", column " << e.column << "\n";
+        if (!errors.empty())
+            result = -1;
+    }
+    return result;
+}
+
+// `pqmarkup_lite --outline input-files...`: writes headers and links of each file (see `Converter::extract_outline()`) as a line of JSON:
+// {"file": ..., "headers": [{"level": 1, "text": ..., "offset": 0}, ...], "links": [{"href": ..., "title": ..., "offset": 9}, ...]}
+// For a file with an error only "file" and "error" are written.
+int outline_main(int argc, char *argv[])
+{
+    Converter converter(true);
+    int result = 0;
+    std::string json;
+    for (int a = 0; a < argc; a++) {
+        std::string input;
+        InputFile infile;
+        std::string_view contents;
+        if (!read_input(argv[a], input, infile, contents)) {
+            result = -1;
+            continue;
+        }
+        json = "{\"file\": ";
+        append_json_string(json, argv[a]);
+        try {
+            Converter::Outline outline = converter.extract_outline(contents);
+            json += ", \"headers\": [";
+            for (auto &&h : outline.headers) {
+                json += &h == &outline.headers[0] ? "{\"level\": " : ", {\"level\": ";
+                json += std::to_string(h.level) + ", \"text\": ";
+                append_json_string(json, h.text);
+                json += ", \"offset\": " + std::to_string(h.offset) + "}";
+            }
+            json += "], \"links\": [";
+            for (auto &&l : outline.links) {
+                json += &l == &outline.links[0] ? "{\"href\": " : ", {\"href\": ";
+                append_json_string(json, l.href);
+                json += ", \"title\": ";
+                append_json_string(json, l.title);
+                json += ", \"offset\": " + std::to_string(l.offset) + "}";
+            }
+            json += "]}\n";
+        }
+        catch (const Exception &e) {
+            json += ", \"error\": ";
+            append_json_string(json, e.message + " at line " + std::to_string(e.line) + ", column " + std::to_string(e.column));
+            json += "}\n";
+            result = -1;
+        }
+        fwrite(json.data(), 1, json.length(), stdout);
+    }
+    return result;
+}
+
+// PQMARKUP_LITE_NO_MAIN leaves out `main()` (e.g. when the engine is built into the Python extension or into tests.cpp)
+#ifndef PQMARKUP_LITE_NO_MAIN
+int main(int argc, char *argv[])
+{
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+        return batch_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--site") == 0)
+        return site_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0)
+        return check_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--outline") == 0)
+        return outline_main(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--jsonl") == 0)
+        return jsonl_main(argc - 2, argv + 2);
+
+    if (argc == 2 && strcmp(argv[1], "-t") == 0) {
+        FILE *tests_file = NULL;
+        fopen_s(&tests_file, "../../tests.txt", "rb");
+        fseek(tests_file, 0, SEEK_END);
+        size_t tests_file_size = ftell(tests_file);
+        fseek(tests_file, 0, SEEK_SET);
+        std::string tests_file_str;
+        tests_file_str.resize(tests_file_size);
+        fread(const_cast<char*>(tests_file_str.data()), tests_file_size, 1, tests_file);
+        fclose(tests_file);
+
+        std::string delim = " (()) ";
+
+        int tests_cnt = 0;
+        for (auto &&test : split(tests_file_str, "|\n\n|")) {
+            tests_cnt++;
+            size_t delim_pos = test.find(delim);
+            std::string left = test.substr(0, delim_pos),
+                       right = test.substr(delim_pos + delim.length());
+            if (to_html(left) != right) {
+                std::cerr << "Error in test #" << tests_cnt << "\n";
+                return -1;
+            }
+        }
+        std::cout << "All of " << tests_cnt << " tests are passed!\n";
+        return 0;
+    }
+
+    PageTemplate page;
+    std::vector<const char*> files;
+    int gzip_level = -1;
+    bool text = false;
+    TextOutput text_out;
+    const char *source_map_path = NULL;
+    bool compact_ohd = false;
+    for (int a = 1; a < argc; a++)
+        if (strcmp(argv[a], "--compact") == 0)
+            compact_ohd = true;
+        else if (strcmp(argv[a], "--source-map") == 0 && a + 1 < argc)
+            source_map_path = argv[++a];
+        else if (strcmp(argv[a], "--text") == 0)
+            text = true;
+        else if (strcmp(argv[a], "--hrefs") == 0)
+            text_out.write_hrefs = true;
+        else if (strcmp(argv[a], "--blocks") == 0)
+            text_out.block_separator = "\n";
+        else if (strcmp(argv[a], "--template") == 0 && a + 1 < argc) {
+            std::string error;
+            if (!page.load(argv[++a], error)) {
+                std::cerr << error << "\n";
+                return -1;
+            }
+        }
+        else if (strncmp(argv[a], "--gzip", 6) == 0 && (argv[a][6] == '\0' || argv[a][6] == '='))
+            gzip_level = parse_gzip_level(argv[a]);
+        else
+            files.push_back(argv[a]);
+    if (compact_ohd)
+        page.set_compact_ohd();
+
+    if (files.size() < 2) {
+        std::cout << "Usage: pqmarkup_lite [--template file] [--gzip[=level]] [--source-map map-file] [--compact] input-file output-file\n"
+                     "       (input-file `-` reads standard input and converts it as it arrives)\n"
+                     "       (in the template file {{body}} is replaced by the converted document, {{title}}, {{header}} and {{name}}\n"
+                     "        by the title, the first header and the value of the [[[name: value]]] comment of the document)\n"
+                     "       (with --gzip output-file.gz compressed at the given level (0-9, 6 by default) is written too)\n"
+                     "       (with --compact brackets and spoilers get short class names and one delegated click handler instead of inline ones)\n"
+                     "       (with --source-map map-file the map from output offsets to input offsets is written into map-file [see SourceMap])\n"
+                     "       pqmarkup_lite --text [--hrefs] [--blocks] [--gzip[=level]] input-file output-file\n"
+                     "       (writes the plain text of the converted document, with link targets after link texts if --hrefs\n"
+                     "        and with a line break at the start and at the end of each block and at each line break if --blocks)\n"
+                     "       pqmarkup_lite --batch [--io=uring|threads|sync] [-j threads] [--depth files-in-flight] [--template file] [--gzip[=level]] [--compact] input-files...\n"
+                     "       (converts each file into a .html file next to it; input-file `-` reads the list of files from standard input)\n"
+                     "       pqmarkup_lite --site source-dir output-dir [--force] [batch options]\n"
+                     "       (converts changed .pq files of source-dir into output-dir)\n"
+                     "       pqmarkup_lite --check [--max-errors n] input-files...\n"
+                     "       (only checks syntax)\n"
+                     "       pqmarkup_lite --outline input-files...\n"
+                     "       (writes headers and links of each file as a line of JSON)\n"
+                     "       pqmarkup_lite --jsonl [-j threads] [--compact]\n"
+                     "       (converts lines {\"id\": ..., \"text\": ...} of standard input into lines {\"id\": ..., \"html\": ...} of standard output)\n";
+        return 0;
+    }
+
+    bool from_stdin = strcmp(files[0], "-") == 0;
+    InputFile infile;
+    if (!from_stdin && !infile.open(files[0])) {
+        std::cerr << "Can't open file '" << files[0] << "'\n";
+        return -1;
+    }
+
+    FILE *outfile = NULL, *gzip_file = NULL;
+    fopen_s(&outfile, files[1], "wb");
+    if (outfile == NULL) {
+        std::cerr << "Can't create file '" << files[1] << "'\n";
+        return -1;
+    }
+    GzipEncoder gzip(gzip_level);
+    if (gzip_level >= 0) {
+        std::string gzip_path = std::string(files[1]) + ".gz";
+        fopen_s(&gzip_file, gzip_path.c_str(), "wb");
+        if (gzip_file == NULL) {
+            std::cerr << "Can't create file '" << gzip_path << "'\n";
+            return -1;
+        }
+    }
+    if (source_map_path != NULL && (from_stdin || text)) {
+        std::cerr << "--source-map needs an input file and HTML output\n";
+        return -1;
+    }
+    SourceMap source_map;
+    size_t output_size = 0;
+    bool output_failed = false, gzip_failed = false; // errors are reported by `close_output()`
+    auto write_output = [outfile, gzip_file, &gzip, source_map_path, &source_map, &output_size, &infile, &output_failed, &gzip_failed](const Output &out) {
+        if (source_map_path != NULL)
+            out.add_to_source_map(source_map, infile.contents, output_size);
+        output_size += out.size();
+#ifndef _WIN32
+        output_failed = output_failed || !out.write_to(fileno(outfile)); // writev() directly from the input file mapping and string literals
+#else
+        output_failed = output_failed || !out.write_to(outfile);
+#endif
+        if (gzip_file != NULL) { // compressed as it is written, so the output is never read again
+            for (auto &&piece : out.get_pieces())
+                gzip.write(piece);
+            gzip_failed = gzip_failed || fwrite(gzip.out.data(), 1, gzip.out.size(), gzip_file) != gzip.out.size();
+            gzip.out.clear();
+        }
+    };
+    // Returns false (after reporting which file could not be written) if anything failed
+    auto close_output = [outfile, gzip_file, &gzip, source_map_path, &source_map, &files, &output_failed, &gzip_failed] {
+        bool ok = true;
+        if ((fclose(outfile) != 0) | output_failed) {
+            std::cerr << "Can't write file '" << files[1] << "'\n";
+            ok = false;
+        }
+        if (source_map_path != NULL) {
+            FILE *f = NULL;
+            fopen_s(&f, source_map_path, "wb");
+            if (f == NULL || fwrite(source_map.encoded().data(), 1, source_map.encoded().size(), f) != source_map.encoded().size() || fclose(f) != 0) {
+                std::cerr << "Can't write file '" << source_map_path << "'\n";
+                ok = false;
+            }
+        }
+        if (gzip_file != NULL) {
+            gzip.finish();
+            gzip_failed = gzip_failed || fwrite(gzip.out.data(), 1, gzip.out.size(), gzip_file) != gzip.out.size();
+            if ((fclose(gzip_file) != 0) | gzip_failed) {
+                std::cerr << "Can't write file '" << files[1] << ".gz'\n";
+                ok = false;
+            }
+        }
+        return ok;
+    };
+    Output out;
+    Converter converter(!text); // plain text is that of brackets without `ohd` (see `Converter::to_text()`)
+    converter.collect_page_info = page.uses_page_info;
+    converter.compact_ohd = page.compact_ohd;
     try {
-        to_html(file_str, outfile, true);
+        if (text) {
+            std::string input;
+            std::string_view contents = infile.contents;
+            if (from_stdin)
+                read_input("-", input, infile, contents);
+            converter.to_html_streaming(contents, text_out, [&](const TextOutput &text_out, size_t converted) {
+                out.write(text_out.str());
+                write_output(out);
+                out.clear();
+                if (!from_stdin)
+                    infile.release_before(converted);
+            });
+            return close_output() ? 0 : -1;
+        }
+
+        if (page.page_info_before_body) { // the title or the header is needed before the body, so convert the whole document at once
+            std::string input;
+            std::string_view contents = infile.contents;
+            if (from_stdin) {
+                char chunk[65536];
+                size_t n;
+                while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0)
+                    input.append(chunk, n);
+                contents = input;
+                if (contents.substr(0, 3) == "\xEF\xBB\xBF")
+                    contents.remove_prefix(3);
+            }
+            page.write_page(converter.page_info, out, [&](Output &out) {converter.to_html(contents, out);});
+            write_output(out);
+            return close_output() ? 0 : -1;
+        }
+
+        page.write_segments(0, page.body, converter.page_info, out);
+        write_output(out);
+        out.clear();
+        if (from_stdin) {
+            StreamConverter stream_converter(true, write_output);
+            stream_converter.get_converter().collect_page_info = page.uses_page_info;
+            stream_converter.get_converter().compact_ohd = page.compact_ohd;
+            static char chunk[65536];
+#ifndef _WIN32
+            ssize_t n;
+            while ((n = read(0, chunk, sizeof(chunk))) != 0) {
+                if (n < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    std::cerr << "Can't read standard input\n";
+                    return -1;
+                }
+#else
+            size_t n;
+            while ((n = fread(chunk, 1, sizeof(chunk), stdin)) > 0) {
+#endif
+                stream_converter.feed(std::string_view(chunk, n));
+            }
+            stream_converter.finish();
+            page.write_segments(page.body + 1, page.segments.size(), stream_converter.get_converter().page_info, out);
+        }
+        else {
+            converter.to_html_streaming(infile.contents, out, [&infile, &write_output](const Output &out, size_t converted) {
+                write_output(out);
+                infile.release_before(converted);
+            });
+            page.write_segments(page.body + 1, page.segments.size(), converter.page_info, out);
+        }
     }
     catch (const Exception &e) {
         std::cerr << e.message << " at line " << e.line << ", column " << e.column << "\n";
         return -1;
     }
 
-    write_to_file(outfile, u8R"(</div>
-</body>
-</html>)");
-
-    fclose(outfile);
+    write_output(out);
+    return close_output() ? 0 : -1;
 }
+#endif
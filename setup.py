@@ -0,0 +1,12 @@
+# Builds the `pqmarkup_lite_native` extension module (the C++ engine with the interface of pqmarkup_lite.py):
+#   python setup.py build_ext --inplace
+#   python tests.py --native
+from setuptools import setup, Extension
+import sys
+
+extra_compile_args = ['/std:c++17', '/O2'] if sys.platform == 'win32' else ['-std=c++17', '-O2', '-DNDEBUG']
+
+setup(
+    name = 'pqmarkup_lite_native',
+    ext_modules = [Extension('pqmarkup_lite_native', ['cpp/utf8_sv/pqmarkup_lite_native.cpp'], extra_compile_args = extra_compile_args)],
+)
@@ -1,4 +1,8 @@
-import os, tempfile, sys, pqmarkup_lite
+import os, tempfile, sys
+if '--native' in sys.argv: # test the C++ engine (build it with `python setup.py build_ext --inplace`)
+    import pqmarkup_lite_native as pqmarkup_lite
+else:
+    import pqmarkup_lite
 
 test_id = 0
 failed_tests = 0
@@ -123,6 +127,27 @@ except pqmarkup_lite.Exception as e:
         failed_tests += 1
 assert(was_error)
 
+# Check the gzip encoder of the C++ engine (`--gzip` option) by decompressing its output
+if '--native' in sys.argv:
+    import gzip, random
+    random.seed(1)
+    text = open('pqmarkup_lite.py', 'rb').read()
+    for name, data in [('empty', b''),
+                       ('text', text),
+                       ('block boundary', (text * (128*1024 // len(text) + 1))[:128*1024 + 258]), # the size at which a block is compressed
+                       ('stored block boundary', bytes(random.getrandbits(8) for i in range(65535 * 2 + 1))), # incompressible: stored blocks of maximum size
+                       ('repetitive', b'ab' * 100000 + b'a' * 300000)]: # long matches and distance 1
+        for level in [0, 1, 6, 9]:
+            for piece_size in [0, 1000]:
+                test_id += 1
+                print("Test " + str(test_id) + " (gzip: " + name + ", level " + str(level) + ", pieces of " + str(piece_size) + ") ...", end = '')
+                compressed = pqmarkup_lite.gzip_compress(data, level, piece_size)
+                if gzip.decompress(compressed) == data and (level != 0 or len(compressed) >= len(data)) and (level == 0 or name != 'repetitive' or len(compressed) < 1000):
+                    print("passed")
+                else:
+                    print("FAILED!")
+                    failed_tests += 1
+
 # Check for presence of TAB and CR characters in source files and forbid them
 test_id += 1
 print("Test " + str(test_id) + ". Checking source files for unallowed characters...")